@@ -6,7 +6,6 @@
 #include <cstdlib>
 #include <cassert>
 #include <algorithm>
-#include <map>
 
 //include header file for glfw library so that we can use OpenGL
 #include <GLFW/glfw3.h>
@@ -14,6 +13,8 @@
 #include <time.h>
 #include <math.h>
 
+#include "Framebuffer.h"
+
 #ifdef _WIN32
 static DWORD lastTime;
 #else
@@ -315,8 +316,9 @@ void update(const Vector &light_dir, const Vector &light_color,
 }
 
 // Helper function to compute all the pixel information to be rendered.
-map<pair<int, int>, Vector> get_pixels(float centerX, float centerY, float radius) {
-    map<pair<int, int>, Vector> mp;
+// Pixels outside the sphere are left black.
+Framebuffer get_pixels(float centerX, float centerY, float radius) {
+    Framebuffer fb(Width_global, Height_global);
 
     const Vector view(0.0, 0.0, 1.0);
 
@@ -355,11 +357,11 @@ map<pair<int, int>, Vector> get_pixels(float centerX, float centerY, float radiu
                 }
 
                 Vector res = ambient + diffuse + specular;
-                mp[make_pair(i, j)] = res;
+                fb.set(i, j, res);
             }
         }
     }
-    return mp;
+    return fb;
 }
 
 // Helper function to parse command line arguments.
@@ -454,10 +456,16 @@ void drawCircle(const float centerX, const float centerY, const float radius) {
     // Draw inner circle
     glBegin(GL_POINTS);
 
-    auto mp = get_pixels(centerX, centerY, radius);
+    Framebuffer fb = get_pixels(centerX, centerY, radius);
 
-    for (const auto &it: mp) { 
-        setPixel(it.first.first, it.first.second, it.second);
+    // Black pixels match the clear color, so only the sphere is drawn.
+    for (int j = 0; j < fb.height; j++) {
+        const float *row = fb.row(j);
+        for (int i = 0; i < fb.width; i++) {
+            const float *p = row + 3 * i;
+            if (p[0] != 0.0f || p[1] != 0.0f || p[2] != 0.0f)
+                setPixel(i, j, Vector(p[0], p[1], p[2]));
+        }
     }
 
     glEnd();
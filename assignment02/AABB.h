@@ -0,0 +1,69 @@
+#ifndef __AABB_H
+#define __AABB_H
+
+#include <algorithm>
+
+#include "Vector.h"
+
+class AABB {
+ public:
+    AABB() : lo(INF, INF, INF), hi(-INF, -INF, -INF) {}
+    AABB(const Vector &lo_, const Vector &hi_) : lo(lo_), hi(hi_) {}
+    ~AABB() = default;
+    bool empty() const {
+        return lo.x > hi.x || lo.y > hi.y || lo.z > hi.z;
+    }
+    void expand(const Vector &p) {
+        lo.set(min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z));
+        hi.set(max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z));
+    }
+    void expand(const AABB &other) {
+        lo.set(min(lo.x, other.lo.x), min(lo.y, other.lo.y), min(lo.z, other.lo.z));
+        hi.set(max(hi.x, other.hi.x), max(hi.y, other.hi.y), max(hi.z, other.hi.z));
+    }
+    // Grows the box by k on every side so thin or flat primitives still get
+    // a box with volume.
+    AABB padded(double k) const {
+        return AABB(lo - k, hi + k);
+    }
+    Vector centroid() const {
+        return (lo + hi) * 0.5;
+    }
+    double surface_area() const {
+        if (empty())
+            return 0.0;
+        Vector d = hi - lo;
+        return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+    // Slab test against the ray segment [0, t_max]. inv_dir is the
+    // componentwise reciprocal of the ray direction; a zero direction
+    // component gives +-inf, and the NaN produced by a ray lying exactly in
+    // a slab plane fails every comparison, which leaves that axis unclipped.
+    bool intersect(const Vector &ray_pos, const Vector &inv_dir,
+                   double t_max, double *t_near) const {
+        double t0 = 0.0, t1 = t_max;
+        if (!slab(lo.x, hi.x, ray_pos.x, inv_dir.x, t0, t1) ||
+            !slab(lo.y, hi.y, ray_pos.y, inv_dir.y, t0, t1) ||
+            !slab(lo.z, hi.z, ray_pos.z, inv_dir.z, t0, t1))
+            return false;
+        *t_near = t0;
+        return true;
+    }
+    Vector lo, hi;
+
+ private:
+    static bool slab(double lo_, double hi_, double pos, double inv,
+                     double &t0, double &t1) {
+        double tn = (lo_ - pos) * inv;
+        double tf = (hi_ - pos) * inv;
+        if (tn > tf)
+            swap(tn, tf);
+        if (tn > t0)
+            t0 = tn;
+        if (tf < t1)
+            t1 = tf;
+        return t0 <= t1;
+    }
+};
+
+#endif
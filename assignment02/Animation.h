@@ -0,0 +1,133 @@
+#ifndef __ANIMATION_H
+#define __ANIMATION_H
+
+#include <algorithm>
+#include <vector>
+
+#include "AABB.h"
+#include "GeoObject.h"
+#include "Matrix.h"
+#include "Packet.h"
+#include "Transformation.h"
+#include "Vector.h"
+
+/**
+ * Keyframed motion for multi-frame renders.
+ *
+ * A track holds keys sorted by frame and is sampled by linear
+ * interpolation of every value; frames before the first or after the last
+ * key hold that key. Camera keys carry the 15 numbers of a cam directive.
+ * Object keys carry a translation, an xfr-style rotation and a uniform
+ * scale, all applied about the center of the object's scene placement.
+ */
+template <int N>
+struct KeyTrack {
+    struct Key {
+        int frame;
+        double v[N];
+    };
+
+    void add(int frame, const double *v) {
+        Key key;
+        key.frame = frame;
+        copy(v, v + N, key.v);
+        auto pos = upper_bound(keys.begin(), keys.end(), frame,
+                               [](int f, const Key &k) { return f < k.frame; });
+        keys.insert(pos, key);
+    }
+    bool empty() const {
+        return keys.empty();
+    }
+    void sample(int frame, double *out) const {
+        size_t i = 0;
+        while (i + 1 < keys.size() && keys[i + 1].frame <= frame)
+            i++;
+        const Key &a = keys[i];
+        const Key &b = keys[min(i + 1, keys.size() - 1)];
+        double w = b.frame > a.frame ? (double)(frame - a.frame) / (b.frame - a.frame) : 0.0;
+        w = max(0.0, min(1.0, w));
+        for (int j = 0; j < N; j++)
+            out[j] = a.v[j] + (b.v[j] - a.v[j]) * w;
+    }
+    vector<Key> keys;
+};
+
+typedef KeyTrack<15> CameraTrack;
+typedef KeyTrack<7> MotionTrack; // tx ty tz rx ry rz scale
+
+/**
+ * Wraps a scene object and moves it rigidly each frame. The object itself
+ * is left untouched; rays are taken into its frame the way Ellipsoid and
+ * MeshInstance do it, so anything the scene can hold can be animated and
+ * meshes stay shared.
+ */
+class AnimatedObject : public GeoObject {
+ public:
+    AnimatedObject(GeoObject *object_, const MotionTrack &track_) :
+        GeoObject(object_->mtrl_id), object(object_), track(track_),
+        base_bounds(object_->bounds()), world_bounds(base_bounds) {}
+    ~AnimatedObject() {
+        delete object;
+    }
+    void set_frame(int frame) {
+        double v[7];
+        track.sample(frame, v);
+        Vector center = base_bounds.centroid();
+        Transformation motion;
+        motion.chain(Translation(center.x + v[0], center.y + v[1], center.z + v[2]), 0);
+        motion.chain(Rotation(v[3], v[4], v[5]), 1);
+        motion.chain(Scaling(v[6], v[6], v[6]), 2);
+        motion.chain(Translation(-center.x, -center.y, -center.z), 0);
+        to_world = motion.mat;
+        to_object = motion.mat.inverse();
+        normal_mat = motion.norm_mat;
+
+        world_bounds = AABB();
+        for (int i = 0; i < 8; i++) {
+            Vector corner((i & 1) ? base_bounds.hi.x : base_bounds.lo.x,
+                          (i & 2) ? base_bounds.hi.y : base_bounds.lo.y,
+                          (i & 4) ? base_bounds.hi.z : base_bounds.lo.z);
+            world_bounds.expand(to_world.apply(corner));
+        }
+        world_bounds = world_bounds.padded(EPS);
+    }
+    bool intersect(const Vector &ray_pos, const Vector &ray_dir, double *t, Vector *normal) {
+        Vector local_normal;
+        if (!object->intersect(to_object.apply(ray_pos), to_object.apply_dir(ray_dir), t,
+                               normal ? &local_normal : nullptr))
+            return false;
+        if (normal)
+            *normal = normal_mat.apply_dir(local_normal).normalized();
+        return true;
+    }
+    bool occluded(const Vector &ray_pos, const Vector &ray_dir, double t_max) {
+        return object->occluded(to_object.apply(ray_pos), to_object.apply_dir(ray_dir), t_max);
+    }
+    AABB bounds() {
+        return world_bounds;
+    }
+    void intersect_packet(RayPacket &packet) {
+        RayPacket local = packet.transformed(to_object);
+        if (packet.has_frustum)
+            local.build_frustum(to_object.apply(packet.apex));
+        object->intersect_packet(local);
+        packet.uncertain |= local.uncertain;
+        for (int k = 0; k < PACKET_SIZE; k++) {
+            if (local.hit[k] != nullptr) {
+                packet.t[k] = local.t[k];
+                packet.hit[k] = this;
+            }
+        }
+    }
+    Vector get_color(const Light &light, const Vector &view, const Vector &pos, const Vector &normal) {
+        return object->get_color(light, view, pos, normal);
+    }
+    GeoObject *object;
+    MotionTrack track;
+    AABB base_bounds, world_bounds;
+    // object's scene placement -> this frame's placement, its inverse, and
+    // the inverse transpose for normals
+    Matrix to_world, to_object, normal_mat;
+};
+
+#endif
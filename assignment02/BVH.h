@@ -0,0 +1,310 @@
+#ifndef __BVH_H
+#define __BVH_H
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "AABB.h"
+#include "RenderStats.h"
+#include "Vector.h"
+
+/**
+ * Bounding volume hierarchy over an arbitrary list of primitive bounds.
+ *
+ * The tree is built top-down with binned SAH over the primitive centroids and
+ * stored flattened in depth-first order: an interior node's left child is the
+ * next node and `offset` points at its right child; a leaf covers `count`
+ * entries of `prim_ids` starting at `offset`. Subtrees over more than
+ * PARALLEL_MIN primitives are built on their own threads, down to the depth
+ * at which there is one subtree per hardware thread; below that each
+ * thread builds its subtree serially.
+ */
+class BVH {
+ public:
+    struct Node {
+        AABB box;
+        int offset;
+        int count; // 0 for interior nodes
+    };
+
+    static const int NUM_BINS = 16;
+    static const int MAX_LEAF = 4;
+    static const int MAX_DEPTH = 64;
+    static const int PARALLEL_MIN = 4096;
+
+    BVH() = default;
+    ~BVH() = default;
+
+    void build(const vector<AABB> &prim_bounds) {
+        nodes.clear();
+        prim_ids.resize(prim_bounds.size());
+        for (int i = 0; i < (int)prim_ids.size(); i++)
+            prim_ids[i] = i;
+        if (prim_ids.empty())
+            return;
+
+        vector<BuildPrim> prims(prim_bounds.size());
+        for (int i = 0; i < (int)prims.size(); i++) {
+            prims[i].box = prim_bounds[i];
+            prims[i].centroid = prim_bounds[i].centroid();
+            prims[i].id = i;
+        }
+        int spawn_depth = 0;
+        while ((1u << spawn_depth) < thread::hardware_concurrency())
+            spawn_depth++;
+        unique_ptr<BuildNode> root = build_recursive(prims, 0, prims.size(), 0, spawn_depth);
+        nodes.reserve(root->size);
+        flatten(root.get());
+        for (int i = 0; i < (int)prims.size(); i++)
+            prim_ids[i] = prims[i].id;
+    }
+
+    /**
+     * Recomputes every node's box from new primitive bounds and keeps the
+     * tree as built. Children follow their parent in `nodes`, so one
+     * backward sweep suffices. Much cheaper than build() for primitives
+     * that moved, but the tree loses quality the farther they move from
+     * where it was built.
+     */
+    void refit(const vector<AABB> &prim_bounds) {
+        for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+            Node &node = nodes[i];
+            AABB box;
+            if (node.count > 0) {
+                for (int k = node.offset; k < node.offset + node.count; k++)
+                    box.expand(prim_bounds[prim_ids[k]]);
+            } else {
+                box = nodes[i + 1].box;
+                box.expand(nodes[node.offset].box);
+            }
+            node.box = box;
+        }
+    }
+
+    bool empty() const {
+        return nodes.empty();
+    }
+
+    AABB bounds() const {
+        return nodes.empty() ? AABB() : nodes[0].box;
+    }
+
+    /**
+     * Walks every leaf whose box overlaps the ray segment [0, *t_max],
+     * nearest child first. visit(prim_id) may shrink *t_max as it finds hits,
+     * which prunes the rest of the walk, and returns true to stop early.
+     * Box tests are tallied locally and added to the stats once per walk.
+     */
+    template <class F>
+    void traverse(const Vector &ray_pos, const Vector &ray_dir,
+                  const double *t_max, F visit) const {
+        traverse_leaves(ray_pos, ray_dir, t_max, [&](int first, int count) {
+            for (int i = first; i < first + count; i++) {
+                if (visit(prim_ids[i]))
+                    return true;
+            }
+            return false;
+        });
+    }
+
+    // As traverse(), but visit_leaf(first, count) gets each leaf whole:
+    // the range [first, first + count) of prim_ids.
+    template <class F>
+    void traverse_leaves(const Vector &ray_pos, const Vector &ray_dir,
+                         const double *t_max, F visit_leaf) const {
+        if (nodes.empty())
+            return;
+        Vector inv_dir(1.0 / ray_dir.x, 1.0 / ray_dir.y, 1.0 / ray_dir.z);
+        int stack[MAX_DEPTH + 1];
+        int top = 0;
+        int box_tests = 1;
+        double t_near;
+        if (nodes[0].box.intersect(ray_pos, inv_dir, *t_max, &t_near))
+            stack[top++] = 0;
+        while (top > 0) {
+            const Node &node = nodes[stack[--top]];
+            if (node.count > 0) {
+                if (visit_leaf(node.offset, node.count))
+                    break;
+                continue;
+            }
+            int left = &node - &nodes[0] + 1;
+            int right = node.offset;
+            double t_left, t_right;
+            bool hit_left = nodes[left].box.intersect(ray_pos, inv_dir, *t_max, &t_left);
+            bool hit_right = nodes[right].box.intersect(ray_pos, inv_dir, *t_max, &t_right);
+            box_tests += 2;
+            if (hit_left && hit_right) {
+                // push the farther child first so the nearer one is popped next
+                if (t_left < t_right) {
+                    stack[top++] = right;
+                    stack[top++] = left;
+                } else {
+                    stack[top++] = left;
+                    stack[top++] = right;
+                }
+            } else if (hit_left) {
+                stack[top++] = left;
+            } else if (hit_right) {
+                stack[top++] = right;
+            }
+        }
+        RenderStats::add(RenderStats::BVH_NODE_TESTS, box_tests);
+    }
+
+    // True as soon as blocks(prim_id) reports a hit within [0, t_max].
+    template <class F>
+    bool occluded(const Vector &ray_pos, const Vector &ray_dir, double t_max, F blocks) const {
+        bool hit = false;
+        traverse(ray_pos, ray_dir, &t_max, [&](int idx) {
+            hit = blocks(idx);
+            return hit;
+        });
+        return hit;
+    }
+
+    vector<Node> nodes;
+    vector<int> prim_ids;
+
+ private:
+    struct BuildPrim {
+        AABB box;
+        Vector centroid;
+        int id;
+    };
+
+    struct BuildNode {
+        AABB box;
+        unique_ptr<BuildNode> left, right;
+        int first, count;
+        int size; // number of nodes in this subtree
+    };
+
+    struct Bin {
+        AABB box;
+        int count = 0;
+    };
+
+    static double axis_of(const Vector &v, int axis) {
+        return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+    }
+
+    static unique_ptr<BuildNode> make_leaf(const AABB &box, int first, int count) {
+        unique_ptr<BuildNode> leaf(new BuildNode);
+        leaf->box = box;
+        leaf->first = first;
+        leaf->count = count;
+        leaf->size = 1;
+        return leaf;
+    }
+
+    // Subtrees at depth < spawn_depth split their left half off onto a new
+    // thread, so at most 2^spawn_depth threads build at once.
+    static unique_ptr<BuildNode> build_recursive(vector<BuildPrim> &prims, int first, int last,
+                                                 int depth, int spawn_depth) {
+        AABB box, centroid_box;
+        for (int i = first; i < last; i++) {
+            box.expand(prims[i].box);
+            centroid_box.expand(prims[i].centroid);
+        }
+        int count = last - first;
+        if (count <= MAX_LEAF || depth >= MAX_DEPTH)
+            return make_leaf(box, first, count);
+
+        // Find the cheapest binned SAH split over all three axes.
+        double best_cost = INF;
+        int best_axis = -1, best_split = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            double lo = axis_of(centroid_box.lo, axis);
+            double extent = axis_of(centroid_box.hi, axis) - lo;
+            if (extent <= 0.0)
+                continue;
+            double scale = NUM_BINS / extent;
+            Bin bins[NUM_BINS];
+            for (int i = first; i < last; i++) {
+                int b = min(NUM_BINS - 1, (int)((axis_of(prims[i].centroid, axis) - lo) * scale));
+                bins[b].count++;
+                bins[b].box.expand(prims[i].box);
+            }
+            double right_area[NUM_BINS];
+            int right_count[NUM_BINS];
+            AABB acc;
+            int acc_count = 0;
+            for (int b = NUM_BINS - 1; b > 0; b--) {
+                acc.expand(bins[b].box);
+                acc_count += bins[b].count;
+                right_area[b] = acc.surface_area();
+                right_count[b] = acc_count;
+            }
+            acc = AABB();
+            acc_count = 0;
+            for (int b = 0; b < NUM_BINS - 1; b++) {
+                acc.expand(bins[b].box);
+                acc_count += bins[b].count;
+                if (acc_count == 0 || right_count[b + 1] == 0)
+                    continue;
+                double cost = acc.surface_area() * acc_count +
+                              right_area[b + 1] * right_count[b + 1];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = b + 1;
+                }
+            }
+        }
+
+        int mid;
+        if (best_axis < 0) {
+            // All centroids coincide; halve the range so leaves stay small.
+            mid = first + count / 2;
+        } else {
+            // One traversal step against one intersection test per primitive.
+            double area = box.surface_area();
+            if (count <= 2 * MAX_LEAF && area > 0.0 && 1.0 + best_cost / area >= count)
+                return make_leaf(box, first, count);
+            double lo = axis_of(centroid_box.lo, best_axis);
+            double scale = NUM_BINS / (axis_of(centroid_box.hi, best_axis) - lo);
+            auto in_left = [&](const BuildPrim &p) {
+                int b = min(NUM_BINS - 1, (int)((axis_of(p.centroid, best_axis) - lo) * scale));
+                return b < best_split;
+            };
+            mid = partition(prims.begin() + first, prims.begin() + last, in_left) - prims.begin();
+        }
+
+        unique_ptr<BuildNode> node(new BuildNode);
+        node->box = box;
+        node->count = 0;
+        if (count >= PARALLEL_MIN && depth < spawn_depth) {
+            future<unique_ptr<BuildNode>> left = async(launch::async, [&, first, mid, depth]() {
+                return build_recursive(prims, first, mid, depth + 1, spawn_depth);
+            });
+            node->right = build_recursive(prims, mid, last, depth + 1, spawn_depth);
+            node->left = left.get();
+        } else {
+            node->left = build_recursive(prims, first, mid, depth + 1, spawn_depth);
+            node->right = build_recursive(prims, mid, last, depth + 1, spawn_depth);
+        }
+        node->size = 1 + node->left->size + node->right->size;
+        return node;
+    }
+
+    void flatten(const BuildNode *node) {
+        int idx = nodes.size();
+        nodes.push_back(Node());
+        nodes[idx].box = node->box;
+        if (!node->left) {
+            nodes[idx].offset = node->first;
+            nodes[idx].count = node->count;
+            return;
+        }
+        nodes[idx].count = 0;
+        flatten(node->left.get());
+        nodes[idx].offset = nodes.size();
+        flatten(node->right.get());
+    }
+};
+
+#endif
@@ -16,12 +16,11 @@ class Camera {
 			  double lrx, double lry, double lrz,
 			  double ulx, double uly, double ulz,
 			  double urx, double ury, double urz) {
- 		cam_instance = new Camera;
- 		cam_instance->loc.set(ex, ey, ez);
- 		cam_instance->ll.set(llx, lly, llz);
- 		cam_instance->lr.set(lrx, lry, lrz);
- 		cam_instance->ul.set(ulx, uly, ulz);
- 		cam_instance->ur.set(urx, ury, urz);
+ 		loc.set(ex, ey, ez);
+ 		ll.set(llx, lly, llz);
+ 		lr.set(lrx, lry, lrz);
+ 		ul.set(ulx, uly, ulz);
+ 		ur.set(urx, ury, urz);
  	}
  	friend ostream& operator<< (ostream &out, Camera &cam) {
  		out << "Loc(" << cam.loc << "), "
@@ -0,0 +1,138 @@
+#ifndef __CHECKPOINT_H
+#define __CHECKPOINT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "Framebuffer.h"
+
+/**
+ * Snapshot of a progressive render: the image so far and how far the pass
+ * schedule got. Every pass before `pass`, and the tiles of `pass` before
+ * `next_tile` in scheduling order, are finished. The tile order depends
+ * only on the window size, so a resume may use another thread count. The
+ * render region, sampling and path settings and the scene file's identity
+ * are stored so a resume with different ones can be refused.
+ */
+struct Checkpoint {
+    static const uint32_t MAGIC = 0x4b435452; // "RTCK"
+    static const uint32_t VERSION = 3;
+
+    int image_width = 0;   // full image size and the crop window's origin;
+    int image_height = 0;  // `image` holds only the window
+    int crop_x0 = 0;
+    int crop_y0 = 0;
+    int pass = 0;
+    int next_tile = 0;
+    long samples_spent = 0;
+    int min_samples = 1;
+    int max_samples = 1;
+    double aa_threshold = 0.0;
+    int max_depth = 0;
+    double min_throughput = 0.0;
+    int use_roulette = 0;
+    std::string scene;       // scene file as given on the command line,
+    uint64_t scene_size = 0; // and its size and modification time
+    int64_t scene_mtime = 0;
+    Framebuffer image;
+    std::vector<float> base_lum; // luminance before the AA pass, once it has started
+
+    // Records path as the scene, with its current size and mtime.
+    bool stat_scene(const std::string &path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            return false;
+        scene = path;
+        scene_size = st.st_size;
+        scene_mtime = st.st_mtime;
+        return true;
+    }
+
+    // Writes to a temporary file and renames it over path, so a crash while
+    // saving leaves the previous checkpoint intact.
+    bool save(const std::string &path) const {
+        std::string tmp = path + ".tmp";
+        FILE *f = fopen(tmp.c_str(), "wb");
+        if (!f)
+            return false;
+        uint32_t header[2] = {MAGIC, VERSION};
+        int32_t ints[12] = {image.width, image.height, pass, next_tile, min_samples, max_samples,
+                            image_width, image_height, crop_x0, crop_y0, max_depth, use_roulette};
+        int64_t spent = samples_spent;
+        double reals[2] = {aa_threshold, min_throughput};
+        uint64_t scene_len = scene.size();
+        uint64_t num_lum = base_lum.size();
+        bool ok = fwrite(header, sizeof(header), 1, f) == 1 &&
+                  fwrite(ints, sizeof(ints), 1, f) == 1 &&
+                  fwrite(&spent, sizeof(spent), 1, f) == 1 &&
+                  fwrite(reals, sizeof(reals), 1, f) == 1 &&
+                  fwrite(&scene_len, sizeof(scene_len), 1, f) == 1 &&
+                  fwrite(scene.data(), 1, scene_len, f) == scene_len &&
+                  fwrite(&scene_size, sizeof(scene_size), 1, f) == 1 &&
+                  fwrite(&scene_mtime, sizeof(scene_mtime), 1, f) == 1 &&
+                  fwrite(image.pixels.data(), sizeof(float), image.pixels.size(), f) == image.pixels.size() &&
+                  fwrite(&num_lum, sizeof(num_lum), 1, f) == 1 &&
+                  fwrite(base_lum.data(), sizeof(float), num_lum, f) == num_lum;
+        ok = fclose(f) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool load(const std::string &path) {
+        FILE *f = fopen(path.c_str(), "rb");
+        if (!f)
+            return false;
+        uint32_t header[2];
+        int32_t ints[12];
+        int64_t spent;
+        double reals[2];
+        uint64_t scene_len = 0;
+        uint64_t num_lum = 0;
+        bool ok = fread(header, sizeof(header), 1, f) == 1 && header[0] == MAGIC && header[1] == VERSION &&
+                  fread(ints, sizeof(ints), 1, f) == 1 && ints[0] > 0 && ints[1] > 0 &&
+                  fread(&spent, sizeof(spent), 1, f) == 1 &&
+                  fread(reals, sizeof(reals), 1, f) == 1 &&
+                  fread(&scene_len, sizeof(scene_len), 1, f) == 1 && scene_len <= PATH_MAX;
+        if (ok) {
+            scene.resize(scene_len);
+            ok = fread(&scene[0], 1, scene_len, f) == scene_len &&
+                 fread(&scene_size, sizeof(scene_size), 1, f) == 1 &&
+                 fread(&scene_mtime, sizeof(scene_mtime), 1, f) == 1;
+        }
+        if (ok) {
+            image.resize(ints[0], ints[1]);
+            pass = ints[2];
+            next_tile = ints[3];
+            min_samples = ints[4];
+            max_samples = ints[5];
+            image_width = ints[6];
+            image_height = ints[7];
+            crop_x0 = ints[8];
+            crop_y0 = ints[9];
+            max_depth = ints[10];
+            use_roulette = ints[11];
+            samples_spent = spent;
+            aa_threshold = reals[0];
+            min_throughput = reals[1];
+            ok = fread(image.pixels.data(), sizeof(float), image.pixels.size(), f) == image.pixels.size() &&
+                 fread(&num_lum, sizeof(num_lum), 1, f) == 1 &&
+                 (num_lum == 0 || num_lum == (uint64_t)ints[0] * ints[1]);
+        }
+        if (ok) {
+            base_lum.resize(num_lum);
+            ok = fread(base_lum.data(), sizeof(float), num_lum, f) == num_lum;
+        }
+        fclose(f);
+        return ok;
+    }
+};
+
+#endif
@@ -0,0 +1,485 @@
+#ifndef __CHUNKED_MESH_H
+#define __CHUNKED_MESH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "AABB.h"
+#include "BVH.h"
+#include "GeoObject.h"
+#include "ObjLoader.h"
+#include "RenderStats.h"
+#include "Vector.h"
+
+/**
+ * Out-of-core triangle mesh.
+ *
+ * convert() sorts the faces of an .obj along a Morton curve over their
+ * centroids and cuts the sequence into chunks of CHUNK_FACES neighbouring
+ * faces. Each chunk is written with its own small BVH to a page-aligned
+ * block of a .chunks file. A ChunkedMesh keeps only the chunk table and a
+ * BVH over the chunk bounds in memory. A chunk is mapped when a ray first
+ * reaches it, and the shared ChunkCache unmaps chunks not used recently
+ * whenever the mapped total would exceed its budget.
+ *
+ * Chunk blocks hold plain arrays (MeshChunks::Node, MeshChunks::Face)
+ * that are read in place from the mapping.
+ */
+namespace MeshChunks {
+
+const uint32_t MAGIC = 0x48435452; // "RTCH"
+const uint32_t VERSION = 1;
+const int CHUNK_FACES = 4096;
+const size_t PAGE = 4096;
+
+struct Header {
+    uint32_t magic, version;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint32_t num_chunks, pad;
+};
+
+struct Entry {
+    double lo[3], hi[3];
+    uint64_t offset, bytes;
+    int32_t num_nodes, num_faces;
+};
+
+// Same tree layout as BVH::Node: an interior node's left child follows
+// it and `offset` is its right child; a leaf covers `count` faces.
+struct Node {
+    double lo[3], hi[3];
+    int32_t offset, count;
+};
+
+struct Face {
+    double a[3], e1[3], e2[3];
+    float normal[3];
+    uint32_t pad;
+};
+
+inline uint64_t spread_bits(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffULL;
+    x = (x | x << 16) & 0x1f0000ff0000ffULL;
+    x = (x | x << 8) & 0x100f00f00f00f00fULL;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+    x = (x | x << 2) & 0x1249249249249249ULL;
+    return x;
+}
+
+inline bool source_stat(const std::string &obj_path, uint64_t *size, int64_t *mtime) {
+    struct stat st;
+    if (stat(obj_path.c_str(), &st) != 0)
+        return false;
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return true;
+}
+
+// True if chunk_path was converted from obj_path as it is now.
+inline bool up_to_date(const std::string &chunk_path, const std::string &obj_path) {
+    Header header;
+    uint64_t size;
+    int64_t mtime;
+    FILE *f = fopen(chunk_path.c_str(), "rb");
+    if (!f)
+        return false;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == MAGIC &&
+              header.version == VERSION && source_stat(obj_path, &size, &mtime) &&
+              header.source_size == size && header.source_mtime == mtime;
+    fclose(f);
+    return ok;
+}
+
+/**
+ * Writes the faces of obj (polygons split into fans) as a chunk file for
+ * the .obj at obj_path. The file is written under a temporary name and
+ * renamed into place. Returns false if there are no faces or the file
+ * cannot be written.
+ */
+inline bool convert(const ObjData &obj, const std::string &obj_path, const std::string &chunk_path) {
+    vector<int> tris;
+    for (int f = 0; f < obj.num_faces(); f++) {
+        const int *idx = &obj.indices[obj.face_start[f]];
+        int n = obj.face_start[f + 1] - obj.face_start[f];
+        for (int k = 2; k < n; k++) {
+            tris.push_back(idx[0]);
+            tris.push_back(idx[k - 1]);
+            tris.push_back(idx[k]);
+        }
+    }
+    int num_tris = tris.size() / 3;
+    if (num_tris == 0)
+        return false;
+    auto vertex = [&](int i) {
+        return Vector(obj.vertices[3 * i], obj.vertices[3 * i + 1], obj.vertices[3 * i + 2]);
+    };
+
+    AABB centroids;
+    for (int t = 0; t < num_tris; t++)
+        centroids.expand((vertex(tris[3 * t]) + vertex(tris[3 * t + 1]) + vertex(tris[3 * t + 2])) / 3.0);
+    Vector extent = centroids.hi - centroids.lo;
+    double scale = 2097151.0 / max<double>(max(extent.x, extent.y), max<double>(extent.z, EPS));
+    vector<pair<uint64_t, int>> order(num_tris);
+    for (int t = 0; t < num_tris; t++) {
+        Vector c = (vertex(tris[3 * t]) + vertex(tris[3 * t + 1]) + vertex(tris[3 * t + 2])) / 3.0 - centroids.lo;
+        order[t].first = spread_bits(c.x * scale) | spread_bits(c.y * scale) << 1 | spread_bits(c.z * scale) << 2;
+        order[t].second = t;
+    }
+    sort(order.begin(), order.end());
+
+    Header header = {MAGIC, VERSION, 0, 0, 0, 0};
+    if (!source_stat(obj_path, &header.source_size, &header.source_mtime))
+        return false;
+    header.num_chunks = (num_tris + CHUNK_FACES - 1) / CHUNK_FACES;
+    vector<Entry> entries(header.num_chunks);
+    std::string tmp = chunk_path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+    size_t table_end = sizeof(Header) + entries.size() * sizeof(Entry);
+    uint64_t offset = (table_end + PAGE - 1) / PAGE * PAGE;
+    bool ok = true;
+    for (int c = 0; c < (int)header.num_chunks && ok; c++) {
+        int first = c * CHUNK_FACES, count = min(CHUNK_FACES, num_tris - first);
+        vector<AABB> bounds(count);
+        vector<Face> faces(count);
+        AABB chunk_box;
+        for (int i = 0; i < count; i++) {
+            const int *v = &tris[3 * order[first + i].second];
+            Vector a = vertex(v[0]), b = vertex(v[1]), cc = vertex(v[2]);
+            Vector e1 = b - a, e2 = cc - a, n = e1.cross(e2).normalized();
+            Face &face = faces[i];
+            face = Face();
+            double *dst[3] = {face.a, face.e1, face.e2};
+            const Vector *src[3] = {&a, &e1, &e2};
+            for (int k = 0; k < 3; k++) {
+                dst[k][0] = src[k]->x;
+                dst[k][1] = src[k]->y;
+                dst[k][2] = src[k]->z;
+            }
+            face.normal[0] = n.x;
+            face.normal[1] = n.y;
+            face.normal[2] = n.z;
+            bounds[i].expand(a);
+            bounds[i].expand(b);
+            bounds[i].expand(cc);
+            bounds[i] = bounds[i].padded(EPS);
+            chunk_box.expand(bounds[i]);
+        }
+        BVH bvh;
+        bvh.build(bounds);
+        vector<Node> nodes(bvh.nodes.size());
+        for (int i = 0; i < (int)nodes.size(); i++) {
+            const BVH::Node &src = bvh.nodes[i];
+            Node &node = nodes[i];
+            node.lo[0] = src.box.lo.x;
+            node.lo[1] = src.box.lo.y;
+            node.lo[2] = src.box.lo.z;
+            node.hi[0] = src.box.hi.x;
+            node.hi[1] = src.box.hi.y;
+            node.hi[2] = src.box.hi.z;
+            node.offset = src.offset;
+            node.count = src.count;
+        }
+        vector<Face> ordered(count);
+        for (int i = 0; i < count; i++)
+            ordered[i] = faces[bvh.prim_ids[i]];
+
+        Entry &entry = entries[c];
+        entry.lo[0] = chunk_box.lo.x;
+        entry.lo[1] = chunk_box.lo.y;
+        entry.lo[2] = chunk_box.lo.z;
+        entry.hi[0] = chunk_box.hi.x;
+        entry.hi[1] = chunk_box.hi.y;
+        entry.hi[2] = chunk_box.hi.z;
+        entry.offset = offset;
+        entry.bytes = nodes.size() * sizeof(Node) + ordered.size() * sizeof(Face);
+        entry.num_nodes = nodes.size();
+        entry.num_faces = count;
+        ok = fseek(f, offset, SEEK_SET) == 0 &&
+             fwrite(nodes.data(), sizeof(Node), nodes.size(), f) == nodes.size() &&
+             fwrite(ordered.data(), sizeof(Face), ordered.size(), f) == ordered.size();
+        offset = (offset + entry.bytes + PAGE - 1) / PAGE * PAGE;
+    }
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1 &&
+         fwrite(entries.data(), sizeof(Entry), entries.size(), f) == entries.size();
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), chunk_path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+}  // namespace MeshChunks
+
+class ChunkedMesh;
+
+/**
+ * Budgeted cache of mapped chunks, shared by every ChunkedMesh, with CLOCK
+ * eviction: a hit only pins the chunk and sets its `used` bit, without
+ * taking the lock, which misses and evictions hold. A chunk in use by some
+ * ray is pinned and never unmapped; if everything mapped is pinned the
+ * budget is exceeded until pins are released.
+ */
+class ChunkCache {
+ public:
+    struct Slot {
+        atomic<const char *> data{nullptr};
+        atomic<int> pins{0};
+        atomic<bool> used{false};
+        size_t bytes = 0;
+    };
+
+    static ChunkCache &instance() {
+        static ChunkCache cache;
+        return cache;
+    }
+
+    const char *acquire(ChunkedMesh *mesh, int chunk);
+    void release(ChunkedMesh *mesh, int chunk);
+
+    size_t budget = 256u << 20;
+    size_t mapped_bytes = 0;
+    size_t peak_bytes = 0;
+
+ private:
+    ChunkCache() = default;
+    mutex lock;
+    vector<pair<ChunkedMesh *, int>> mapped; // the clock, swept from hand
+    size_t hand = 0;
+};
+
+class ChunkedMesh : public GeoObject {
+ public:
+    ChunkedMesh() : fd(-1) {}
+    ChunkedMesh(const ChunkedMesh &) = delete;
+    ChunkedMesh &operator=(const ChunkedMesh &) = delete;
+    ~ChunkedMesh() {
+        for (auto &slot : slots) {
+            if (const char *data = slot.data)
+                munmap(const_cast<char *>(data), slot.bytes);
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // Reads the chunk table of a .chunks file and builds the top-level BVH.
+    bool open(const std::string &path_) {
+        path = path_;
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        MeshChunks::Header header;
+        if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+            header.magic != MeshChunks::MAGIC || header.version != MeshChunks::VERSION)
+            return false;
+        entries.resize(header.num_chunks);
+        size_t table_bytes = entries.size() * sizeof(MeshChunks::Entry);
+        if (pread(fd, entries.data(), table_bytes, sizeof(header)) != (ssize_t)table_bytes)
+            return false;
+        slots = vector<ChunkCache::Slot>(entries.size());
+        vector<AABB> bounds(entries.size());
+        for (int c = 0; c < (int)entries.size(); c++) {
+            const MeshChunks::Entry &e = entries[c];
+            bounds[c] = AABB(Vector(e.lo[0], e.lo[1], e.lo[2]), Vector(e.hi[0], e.hi[1], e.hi[2]));
+            num_faces += e.num_faces;
+        }
+        top.build(bounds);
+        return true;
+    }
+    bool intersect(const Vector &ray_pos, const Vector &ray_dir, double *t, Vector *normal) {
+        Vector inv_dir(1.0 / ray_dir.x, 1.0 / ray_dir.y, 1.0 / ray_dir.z);
+        int tests = 0, hits = 0;
+        top.traverse(ray_pos, ray_dir, t, [&](int c) {
+            const char *data = ChunkCache::instance().acquire(this, c);
+            walk_chunk(data, entries[c], ray_pos, inv_dir, t, [&](const MeshChunks::Face &face) {
+                tests++;
+                if (face_hit(face, ray_pos, ray_dir, t)) {
+                    // copied now, as the chunk may be unmapped once released
+                    if (normal)
+                        normal->set(face.normal[0], face.normal[1], face.normal[2]);
+                    hits++;
+                }
+                return false;
+            });
+            ChunkCache::instance().release(this, c);
+            return false;
+        });
+        RenderStats::add(RenderStats::MESH_FACE_TESTS, tests);
+        RenderStats::add(RenderStats::MESH_FACE_HITS, hits);
+        return hits > 0;
+    }
+    bool occluded(const Vector &ray_pos, const Vector &ray_dir, double t_max) {
+        Vector inv_dir(1.0 / ray_dir.x, 1.0 / ray_dir.y, 1.0 / ray_dir.z);
+        int tests = 0;
+        bool hit = top.occluded(ray_pos, ray_dir, t_max, [&](int c) {
+            const char *data = ChunkCache::instance().acquire(this, c);
+            bool blocked = false;
+            double t = t_max;
+            walk_chunk(data, entries[c], ray_pos, inv_dir, &t, [&](const MeshChunks::Face &face) {
+                tests++;
+                double face_t = t_max;
+                blocked = face_hit(face, ray_pos, ray_dir, &face_t);
+                return blocked;
+            });
+            ChunkCache::instance().release(this, c);
+            return blocked;
+        });
+        RenderStats::add(RenderStats::MESH_FACE_TESTS, tests);
+        RenderStats::add(RenderStats::MESH_FACE_HITS, hit);
+        return hit;
+    }
+    AABB bounds() {
+        return top.bounds();
+    }
+    int num_chunks() const {
+        return entries.size();
+    }
+
+    vector<MeshChunks::Entry> entries;
+    vector<ChunkCache::Slot> slots;
+    BVH top;
+    std::string path;
+    long num_faces = 0;
+    int fd;
+
+ private:
+    static bool slab(const double *lo, const double *hi, const Vector &pos, const Vector &inv_dir,
+                     double t_max, double *t_near) {
+        double p[3] = {pos.x, pos.y, pos.z}, inv[3] = {inv_dir.x, inv_dir.y, inv_dir.z};
+        double t0 = 0.0, t1 = t_max;
+        for (int k = 0; k < 3; k++) {
+            double tn = (lo[k] - p[k]) * inv[k], tf = (hi[k] - p[k]) * inv[k];
+            if (tn > tf)
+                swap(tn, tf);
+            t0 = max(t0, tn);
+            t1 = min(t1, tf);
+            if (t0 > t1)
+                return false;
+        }
+        *t_near = t0;
+        return true;
+    }
+
+    // Nearest-first walk of one chunk's BVH, as BVH::traverse does it.
+    template <class F>
+    static void walk_chunk(const char *data, const MeshChunks::Entry &entry, const Vector &ray_pos,
+                           const Vector &inv_dir, const double *t_max, F visit) {
+        const MeshChunks::Node *nodes = reinterpret_cast<const MeshChunks::Node *>(data);
+        const MeshChunks::Face *faces = reinterpret_cast<const MeshChunks::Face *>(nodes + entry.num_nodes);
+        int stack[BVH::MAX_DEPTH + 1];
+        int top = 0, box_tests = 1;
+        double t_near;
+        if (slab(nodes[0].lo, nodes[0].hi, ray_pos, inv_dir, *t_max, &t_near))
+            stack[top++] = 0;
+        while (top > 0) {
+            const MeshChunks::Node &node = nodes[stack[--top]];
+            if (node.count > 0) {
+                bool stop = false;
+                for (int i = node.offset; i < node.offset + node.count && !stop; i++)
+                    stop = visit(faces[i]);
+                if (stop)
+                    break;
+                continue;
+            }
+            int left = &node - nodes + 1, right = node.offset;
+            double t_left, t_right;
+            bool hit_left = slab(nodes[left].lo, nodes[left].hi, ray_pos, inv_dir, *t_max, &t_left);
+            bool hit_right = slab(nodes[right].lo, nodes[right].hi, ray_pos, inv_dir, *t_max, &t_right);
+            box_tests += 2;
+            if (hit_left && hit_right) {
+                if (t_left < t_right) {
+                    stack[top++] = right;
+                    stack[top++] = left;
+                } else {
+                    stack[top++] = left;
+                    stack[top++] = right;
+                }
+            } else if (hit_left) {
+                stack[top++] = left;
+            } else if (hit_right) {
+                stack[top++] = right;
+            }
+        }
+        RenderStats::add(RenderStats::BVH_NODE_TESTS, box_tests);
+    }
+
+    static bool face_hit(const MeshChunks::Face &face, const Vector &ray_pos, const Vector &ray_dir, double *t) {
+        return Triangle::hit(Vector(face.a[0], face.a[1], face.a[2]), Vector(face.e1[0], face.e1[1], face.e1[2]),
+                             Vector(face.e2[0], face.e2[1], face.e2[2]), ray_pos, ray_dir, t);
+    }
+};
+
+inline const char *ChunkCache::acquire(ChunkedMesh *mesh, int chunk) {
+    Slot &slot = mesh->slots[chunk];
+    // Pin before looking at data: eviction clears data before it checks the
+    // pins, so either this sees null or the evictor sees the pin and backs off.
+    slot.pins++;
+    const char *data = slot.data;
+    if (data) {
+        RenderStats::add(RenderStats::CHUNK_HITS);
+        slot.used.store(true, memory_order_relaxed);
+        return data;
+    }
+    lock_guard<mutex> guard(lock);
+    if ((data = slot.data)) {
+        // mapped, or an eviction backed off, while this waited for the lock
+        RenderStats::add(RenderStats::CHUNK_HITS);
+        slot.used.store(true, memory_order_relaxed);
+        return data;
+    }
+    RenderStats::add(RenderStats::CHUNK_MISSES);
+    const MeshChunks::Entry &entry = mesh->entries[chunk];
+    // sweep the clock: recently used chunks get a second chance and pinned
+    // ones are skipped; two turns visit every chunk with its bit cleared
+    for (size_t steps = 2 * mapped.size(); steps > 0 && !mapped.empty() && mapped_bytes + entry.bytes > budget; steps--) {
+        hand %= mapped.size();
+        Slot &victim = mapped[hand].first->slots[mapped[hand].second];
+        if (victim.used.exchange(false, memory_order_relaxed)) {
+            hand++;
+            continue;
+        }
+        const char *victim_data = victim.data.exchange(nullptr);
+        if (victim.pins > 0) {
+            victim.data = victim_data;
+            hand++;
+            continue;
+        }
+        munmap(const_cast<char *>(victim_data), victim.bytes);
+        mapped_bytes -= victim.bytes;
+        mapped[hand] = mapped.back();
+        mapped.pop_back();
+        RenderStats::add(RenderStats::CHUNK_EVICTIONS);
+    }
+    void *addr = mmap(nullptr, entry.bytes, PROT_READ, MAP_PRIVATE, mesh->fd, entry.offset);
+    if (addr == MAP_FAILED) {
+        perror("mmap of mesh chunk");
+        abort();
+    }
+    slot.bytes = entry.bytes;
+    slot.used.store(true, memory_order_relaxed);
+    slot.data = data = static_cast<const char *>(addr);
+    mapped.push_back(make_pair(mesh, chunk));
+    mapped_bytes += entry.bytes;
+    peak_bytes = max(peak_bytes, mapped_bytes);
+    return data;
+}
+
+inline void ChunkCache::release(ChunkedMesh *mesh, int chunk) {
+    mesh->slots[chunk].pins--;
+}
+
+#endif
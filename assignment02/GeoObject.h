@@ -4,27 +4,57 @@
 #include <cmath>
 #include <iostream>
 
+#include "AABB.h"
 #include "Light.h"
 #include "Material.h"
+#include "Packet.h"
+#include "RenderStats.h"
 #include "Vector.h"
 #include "Transformation.h"
 
 class GeoObject {
  public:
  	GeoObject() = default;
- 	GeoObject(Material mtrl_) : mtrl(mtrl_) {}
-    ~GeoObject() = default;
+ 	GeoObject(MaterialId mtrl_id_) : mtrl_id(mtrl_id_) {}
+    virtual ~GeoObject() = default;
+ 	// Closest hit closer than *t; updates *t and, unless it is null, *normal.
  	virtual bool intersect(const Vector &ray_pos, const Vector &ray_dir, double *t, Vector *normal) = 0;
+    // Any hit closer than t_max. Shadow rays only need a yes or no, so
+    // no normal is computed.
+    virtual bool occluded(const Vector &ray_pos, const Vector &ray_dir, double t_max) {
+        return intersect(ray_pos, ray_dir, &t_max, nullptr);
+    }
+    // World-space box enclosing every point intersect() can report.
+    virtual AABB bounds() = 0;
+    // Closest-hit test for every active ray of a packet. Falls back to one
+    // intersect() call per ray for shapes without a vectorized kernel.
+    virtual void intersect_packet(RayPacket &packet) {
+        for (int k = 0; k < PACKET_SIZE; k++) {
+            if (!((packet.active >> k) & 1))
+                continue;
+            double t = packet.t[k];
+            Vector normal;
+            if (intersect(Vector(packet.ox[k], packet.oy[k], packet.oz[k]), packet.dir(k), &t, &normal)) {
+                packet.t[k] = t;
+                packet.hit[k] = this;
+            }
+        }
+        // Tested on the float rounded rays, so no answer can be trusted.
+        packet.uncertain |= packet.active;
+    }
     virtual Vector get_color(const Light &light, const Vector &view, const Vector &pos, const Vector &normal) {
-        return light.get_color(view, pos, normal, mtrl);
+        return light.get_color(view, pos, normal, material());
+    }
+    const Material &material() const {
+        return MaterialTable::get(mtrl_id);
     }
- 	Material mtrl;
+    MaterialId mtrl_id = 0;
 };
 
 class Sphere : public GeoObject {
  public:
  	Sphere() = default;
- 	Sphere(double x_, double y_, double z_, double radius_, Material mtrl_) :
+ 	Sphere(double x_, double y_, double z_, double radius_, MaterialId mtrl_) :
  		GeoObject(mtrl_), center(x_, y_, z_), radius(radius_) {}
  	~Sphere() = default;
     bool aabb_intersect(const Vector &center, double radius,
@@ -43,8 +73,10 @@ class Sphere : public GeoObject {
         if (tymin > tymax)
             swap(tymin, tymax);
 
-        if ((tmin > tymax) || (tymin > tmax))
+        if ((tmin > tymax) || (tymin > tmax)) {
+            RenderStats::add(RenderStats::AABB_REJECTS);
             return false;
+        }
 
         if (tymin > tmin)
             tmin = tymin;
@@ -57,12 +89,15 @@ class Sphere : public GeoObject {
         if (tzmin > tzmax)
             swap(tzmin, tzmax);
 
-        if ((tmin > tzmax) || (tzmin > tmax))
+        if ((tmin > tzmax) || (tzmin > tmax)) {
+            RenderStats::add(RenderStats::AABB_REJECTS);
             return false;
+        }
 
         return true;
     }
  	bool intersect(const Vector &ray_pos, const Vector &ray_dir, double *t, Vector *normal) {
+        RenderStats::add(RenderStats::SPHERE_TESTS);
         if (!aabb_intersect(center, radius, ray_pos, ray_dir))
             return false;
  		Vector temp = ray_pos - center;
@@ -79,15 +114,25 @@ class Sphere : public GeoObject {
  			t0 = t1;
  		// Ensure that t0 is greater than zero and less than best t.
  		if (t0 > EPS && (t0 < *t)) {
-            Vector intersect_pt = ray_pos + ray_dir * t0;
-            *normal = intersect_pt - center;
-            normal->normalize();
+            if (normal) {
+                Vector intersect_pt = ray_pos + ray_dir * t0;
+                *normal = intersect_pt - center;
+                normal->normalize();
+            }
             *t = t0;
+            RenderStats::add(RenderStats::SPHERE_HITS);
  			return true;
  		} else {
  			return false;
  		}
  	}
+    AABB bounds() {
+        return AABB(center - radius, center + radius).padded(EPS);
+    }
+    void intersect_packet(RayPacket &packet) {
+        float c[3] = {(float)center.x, (float)center.y, (float)center.z};
+        packet_kernels().sphere(packet, c, sqr(radius), this);
+    }
  	friend ostream& operator<< (ostream &out, Sphere &sph) {
  		out << "S(" << sph.center << ", " << sph.radius << ")" << endl;
  		return out;
@@ -100,24 +145,42 @@ class Ellipsoid : public Sphere {
  public:
     Ellipsoid() = default;
     Ellipsoid(double x_, double y_, double z_, double radius_,
-              Material mtrl_, Transformation trans_) :
+              MaterialId mtrl_, const Transformation &trans_) :
         Sphere(x_, y_, z_, radius_, mtrl_) {
             // scale, rotate, then translate
-            trans_.pre_chain(Scaling(radius_, radius_, radius_), 2);
-            trans_.pre_chain(Translation(x_, y_, z_), 0);
-
-            trans = trans_;
-            trans_inv = trans_.inverse();
-            trans_inv_t = trans_inv.transpose();
+            Transformation trans = trans_;
+            trans.pre_chain(Scaling(radius_, radius_, radius_), 2);
+            trans.pre_chain(Translation(x_, y_, z_), 0);
+
+            to_world = trans.mat;
+            to_object = trans.mat.inverse();
+            normal_mat = trans.norm_mat;
+
+            // The unit sphere maps to an ellipsoid whose extent along world
+            // axis i is the length of row i of the linear block, which gives
+            // the tightest box. The radius leaves room for the EPS slack
+            // intersect() allows.
+            double r = 1.0 + 4 * EPS;
+            Vector center(to_world[0][3], to_world[1][3], to_world[2][3]);
+            Vector half(Vector(to_world[0][0], to_world[0][1], to_world[0][2]).norm(),
+                        Vector(to_world[1][0], to_world[1][1], to_world[1][2]).norm(),
+                        Vector(to_world[2][0], to_world[2][1], to_world[2][2]).norm());
+            world_bounds = AABB(center - half * r, center + half * r).padded(EPS);
         }
     ~Ellipsoid() = default;
     bool intersect(const Vector &ray_pos_t, const Vector &ray_dir_t, double *t, Vector *normal) {
-        // transform ray from world space to object space
-        Vector ray_pos = trans_inv.apply(ray_pos_t);
-        Vector ray_dir = trans_inv.apply_dir(ray_dir_t);
-
-        if (!aabb_intersect(Vector(0, 0, 0), 1.0, ray_pos, ray_dir))
+        RenderStats::add(RenderStats::ELLIPSOID_TESTS);
+        // Rays that miss the world box never pay for the transform.
+        double t_near;
+        Vector inv_dir(1.0 / ray_dir_t.x, 1.0 / ray_dir_t.y, 1.0 / ray_dir_t.z);
+        if (!world_bounds.intersect(ray_pos_t, inv_dir, *t, &t_near)) {
+            RenderStats::add(RenderStats::AABB_REJECTS);
             return false;
+        }
+        // transform ray from world space to object space; the direction is
+        // not renormalized, so t means the same distance in both spaces
+        Vector ray_pos = to_object.apply(ray_pos_t);
+        Vector ray_dir = to_object.apply_dir(ray_dir_t);
 
         Vector temp = ray_pos + EPS;
         double A = ray_dir.dot(ray_dir);
@@ -131,133 +194,121 @@ class Ellipsoid : public Sphere {
         double t1 = (-B - sqrt_discriminant) / (2.0 * A);
         if (t0 - t1 > EPS)
             t0 = t1;
-        // Transform t0 to world space
-        Vector intersection_obj_space = ray_pos + ray_dir * t0;
-        Vector intersection_world_space = trans.apply(intersection_obj_space);
-        if (fabs(ray_dir_t.x) > EPS)
-            t0 = (intersection_world_space.x - ray_pos_t.x) / ray_dir_t.x;
-        else if (fabs(ray_dir_t.y) > EPS)
-            t0 = (intersection_world_space.y - ray_pos_t.y) / ray_dir_t.y;
-        else if (fabs(ray_dir_t.z) > EPS)
-            t0 = (intersection_world_space.z - ray_pos_t.z) / ray_dir_t.z;
-        else
-            t0 = INF + 1.0;
         // Ensure that t0 is greater than zero and less than best t.
         if (t0 > EPS && (t0 < *t)) {
             *t = t0;
-            *normal = trans_inv_t.apply_norm(intersection_obj_space);
-            normal->normalize();
+            if (normal) {
+                *normal = normal_mat.apply_dir(ray_pos + ray_dir * t0);
+                normal->normalize();
+            }
+            RenderStats::add(RenderStats::ELLIPSOID_HITS);
             return true;
         } else {
             return false;
         }
     }
-    Transformation trans, trans_inv, trans_inv_t; // inverse transformation matrix from world space to
-                                                  // unit sphere space
+    AABB bounds() {
+        return world_bounds;
+    }
+    void intersect_packet(RayPacket &packet) {
+        // Object space t equals world space t since the map is affine, so
+        // the unit sphere kernel's distances can be used directly.
+        RayPacket local = packet.transformed(to_object);
+        // Same EPS-shifted sphere as intersect()
+        float c[3] = {(float)-EPS, (float)-EPS, (float)-EPS};
+        packet_kernels().sphere(local, c, 1.0 + EPS, this);
+        packet.uncertain |= local.uncertain;
+        for (int k = 0; k < PACKET_SIZE; k++) {
+            if (local.hit[k] == this) {
+                packet.t[k] = local.t[k];
+                packet.hit[k] = this;
+            }
+        }
+    }
+    // unit sphere space -> world space, its inverse, and the inverse
+    // transpose for normals
+    Matrix to_world, to_object, normal_mat;
+    AABB world_bounds;
 };
 
 class Triangle : public GeoObject {
  public:
  	Triangle() = default;
-    Triangle(Vector a, Vector b, Vector c, Material mtrl_) :
+    Triangle(Vector a, Vector b, Vector c, MaterialId mtrl_) :
         Triangle(a.x, a.y, a.z, b.x, b.y, b.z, c.x, c.y, c.z, mtrl_) {}
  	Triangle(double ax_, double ay_, double az_,
  			 double bx_, double by_, double bz_,
  			 double cx_, double cy_, double cz_,
- 			 Material mtrl_) :
- 		GeoObject(mtrl_), a(ax_, ay_, az_), b(bx_, by_, bz_), c(cx_, cy_, cz_) {
-        double minx, maxx, miny, maxy, minz, maxz;
-        minx = min(ax_, min(bx_, cx_));
-        maxx = max(ax_, max(bx_, cx_));
-
-        miny = min(ay_, min(by_, cy_));
-        maxy = max(ay_, max(by_, cy_));
-
-        minz = min(az_, min(bz_, cz_));
-        maxz = max(az_, max(bz_, cz_));
-        minvert = Vector(minx, miny, minz);
-        maxvert = Vector(maxx, maxy, maxz);
+ 			 MaterialId mtrl_) :
+ 		GeoObject(mtrl_), a(ax_, ay_, az_) {
+        // edges and normal are fixed, so they are computed once here
+        // rather than on every ray
+        e1 = Vector(bx_, by_, bz_) - a;
+        e2 = Vector(cx_, cy_, cz_) - a;
+        normal = e1.cross(e2).normalized();
     }
     ~Triangle() = default;
-    bool aabb_intersect(const Vector &ray_pos, const Vector &ray_dir) {
-        float tmin = (minvert.x - ray_pos.x) / ray_dir.x;
-        float tmax = (maxvert.x - ray_pos.x) / ray_dir.x;
-
-        if (tmin > tmax)
-            swap(tmin, tmax);
-
-        float tymin = (minvert.y - ray_pos.y) / ray_dir.y;
-        float tymax = (maxvert.y - ray_pos.y) / ray_dir.y;
-
-        if (tymin > tymax)
-            swap(tymin, tymax);
-
-        if ((tmin > tymax) || (tymin > tmax))
+ 	bool intersect(const Vector &ray_pos, const Vector &ray_dir, double *t, Vector *normal_) {
+        RenderStats::add(RenderStats::TRIANGLE_TESTS);
+        if (!hit(a, e1, e2, ray_pos, ray_dir, t))
             return false;
-
-        if (tymin > tmin)
-            tmin = tymin;
-        if (tymax < tmax)
-            tmax = tymax;
-
-        float tzmin = (minvert.z - ray_pos.z) / ray_dir.z;
-        float tzmax = (maxvert.z - ray_pos.z) / ray_dir.z;
-
-        if (tzmin > tzmax)
-            swap(tzmin, tzmax);
-
-        if ((tmin > tzmax) || (tzmin > tmax))
+        if (normal_)
+            *normal_ = normal;
+        RenderStats::add(RenderStats::TRIANGLE_HITS);
+        return true;
+ 	}
+    /**
+     * Moller-Trumbore test of the ray against the triangle with corner a
+     * and edges e1, e2. Hits inside the triangle or on its edges, at
+     * 0 <= t < *t, count: edges are inclusive so a ray through the edge
+     * two triangles share hits one of them instead of slipping between
+     * both. On a hit *t is updated and, if given, *u and *v
+     * receive the barycentric weights of the second and third corners.
+     */
+    static bool hit(const Vector &a, const Vector &e1, const Vector &e2,
+                    const Vector &ray_pos, const Vector &ray_dir,
+                    double *t, double *u = nullptr, double *v = nullptr) {
+        Vector p = ray_dir.cross(e2);
+        double det = e1.dot(p);
+        if (fabs(det) < EPS)
+            return false; // ray and triangle are parallel
+        double inv_det = 1.0 / det;
+        Vector s = ray_pos - a;
+        double hit_u = s.dot(p) * inv_det;
+        if (hit_u < 0.0 || hit_u > 1.0)
             return false;
-
+        Vector q = s.cross(e1);
+        double hit_v = ray_dir.dot(q) * inv_det;
+        if (hit_v < 0.0 || hit_u + hit_v > 1.0)
+            return false;
+        double hit_t = e2.dot(q) * inv_det;
+        if (hit_t < 0.0 || hit_t >= *t)
+            return false;
+        *t = hit_t;
+        if (u)
+            *u = hit_u;
+        if (v)
+            *v = hit_v;
         return true;
     }
- 	bool intersect(const Vector &ray_pos, const Vector &ray_dir, double *t, Vector *normal) {
-        if (!aabb_intersect(ray_pos, ray_dir))
-            return false;
-        // two vectors of plane and normal
-        Vector A = b - a;
-        Vector B = c - a;
-        Vector N = A.cross(B);
-
-        double denominator = N.dot(ray_dir);
-        if (fabs(denominator) < EPS) {
-            return false; // ray and triangle are parallel
-        }
-
-        double D = -N.dot(a);
-        double numerator = N.dot(ray_pos) + D;
-        double intersect_t = -numerator / denominator;
-        if (intersect_t < 0.0)
-            return false; // triangle is behind
-        Vector intersection = ray_pos + ray_dir * intersect_t;
-        Vector edge0 = b - a;
-        Vector edge1 = c - b;
-        Vector edge2 = a - c;
-        Vector c0 = intersection - a;
-        Vector c1 = intersection - b;
-        Vector c2 = intersection - c;
-        bool intersect = false;
-        double res0 = N.dot(edge0.cross(c0));
-        double res1 = N.dot(edge1.cross(c1));
-        double res2 = N.dot(edge2.cross(c2));
-        if (res0 > 0 && res1 > 0 && res2 > 0) {
-            intersect = true;
-        }
-
-        if (intersect && *t > intersect_t) {
-            *t = intersect_t;
-            *normal = get_normal();
-            return true;
-        }
-        return false;
- 	}
+    AABB bounds() {
+        AABB box;
+        box.expand(a);
+        box.expand(a + e1);
+        box.expand(a + e2);
+        return box.padded(EPS);
+    }
+    void intersect_packet(RayPacket &packet) {
+        float v0[3] = {(float)a.x, (float)a.y, (float)a.z};
+        float f1[3] = {(float)e1.x, (float)e1.y, (float)e1.z};
+        float f2[3] = {(float)e2.x, (float)e2.y, (float)e2.z};
+        packet_kernels().triangle(packet, v0, f1, f2, this);
+    }
     Vector get_normal() {
-        Vector A = b - a;
-        Vector B = c - a;
-        return A.cross(B).normalized();
+        return normal;
     }
- 	Vector a, b, c;
-    Vector minvert, maxvert;
+ 	Vector a, e1, e2;
+    Vector normal;
 };
 
 #endif
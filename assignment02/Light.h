@@ -23,8 +23,8 @@ class Light {
         Vector reflected = (2 * normal.dot(light_dir) * normal) - light_dir;
         reflected.normalize();
 
-        double LdotN = max(light_dir.dot(normal), 0.0);
-        double RdotV = max(reflected.dot(view), 0.0);
+        double LdotN = max<double>(light_dir.dot(normal), 0.0);
+        double RdotV = max<double>(reflected.dot(view), 0.0);
         double dF = max(LdotN, 0.0);
         double sF = pow(RdotV, mtrl.sp_k);
 
@@ -99,8 +99,8 @@ class SpotLight : public PointLight {
         Vector reflected = (2 * normal.dot(light_dir) * normal) - light_dir;
         reflected.normalize();
 
-        double LdotN = max(light_dir.dot(normal), 0.0);
-        double RdotV = max(reflected.dot(view), 0.0);
+        double LdotN = max<double>(light_dir.dot(normal), 0.0);
+        double RdotV = max<double>(reflected.dot(view), 0.0);
         double dF = max(LdotN, 0.0);
         double sF = pow(RdotV, mtrl.sp_k);
 
@@ -1,6 +1,12 @@
 #ifndef __MATERIAL_H
 #define __MATERIAL_H
 
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <vector>
+
 #include "Vector.h"
 
 class Material {
@@ -17,8 +23,61 @@ class Material {
 	Vector ambient; // ambient
 	Vector diffuse; // diffuse
 	Vector specular;
-	double sp_k; // specular
+	double sp_k = 0.0; // specular
 	Vector reflective; // reflective
+	// Most bounces a ray reflected off this material may take, counting
+	// its own; -1 leaves it to the scene's depth.
+	int max_bounces = -1;
+};
+
+typedef uint16_t MaterialId;
+
+/**
+ * Every distinct material of the scene, stored once. Objects keep only a
+ * MaterialId and look the material up when a hit is shaded. Entry 0 is
+ * the default material of objects declared before any mat directive.
+ */
+class MaterialTable {
+ public:
+    static const int MAX_MATERIALS = 65536;
+
+    static MaterialTable &instance() {
+        static MaterialTable table;
+        return table;
+    }
+    static const Material &get(MaterialId id) {
+        return instance().materials[id];
+    }
+    // Id of a material equal to mtrl, adding it if it is new.
+    MaterialId intern(const Material &mtrl) {
+        Key key = {mtrl.ambient.x, mtrl.ambient.y, mtrl.ambient.z,
+                   mtrl.diffuse.x, mtrl.diffuse.y, mtrl.diffuse.z,
+                   mtrl.specular.x, mtrl.specular.y, mtrl.specular.z, mtrl.sp_k,
+                   mtrl.reflective.x, mtrl.reflective.y, mtrl.reflective.z,
+                   (double)mtrl.max_bounces};
+        auto found = ids.find(key);
+        if (found != ids.end())
+            return found->second;
+        if (materials.size() >= MAX_MATERIALS) {
+            std::cerr << "More than " << MAX_MATERIALS << " materials; using the default for the rest." << std::endl;
+            return 0;
+        }
+        MaterialId id = materials.size();
+        materials.push_back(mtrl);
+        ids[key] = id;
+        return id;
+    }
+    size_t size() const {
+        return materials.size();
+    }
+    std::vector<Material> materials;
+
+ private:
+    typedef std::array<double, 14> Key;
+    MaterialTable() {
+        intern(Material());
+    }
+    std::map<Key, MaterialId> ids;
 };
 
 #endif
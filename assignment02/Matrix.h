@@ -1,105 +1,112 @@
 #ifndef __MATRIX_H
 #define __MATRIX_H
 
-#include <cassert>
-
 #include "Vector.h"
 
+/**
+ * Affine 4x4 matrix stored inline as its top 3x4 block; the bottom row is
+ * always (0, 0, 0, 1). Each row is one 32-byte aligned group of four
+ * doubles so the compiler can keep it in a single AVX register.
+ */
 class Matrix {
  public:
- 	Matrix() = default;
- 	Matrix(int n) {
- 		vals.resize(n, vector<double>(n, 0.0));
-        sz = n;
- 	}
-    Matrix(const Matrix &other) {
-        vals = other.vals;
-        sz = other.sz;
-    }
-    static Matrix identity(int n) {
-        Matrix mat(n);
-        for (int i = 0; i < n; i++) {
-            mat.vals[i][i] = 1.0;
-        }
-        return mat;
+    static constexpr int sz = 4;
+
+    constexpr Matrix() : vals{{1.0, 0.0, 0.0, 0.0}, {0.0, 1.0, 0.0, 0.0}, {0.0, 0.0, 1.0, 0.0}} {}
+    constexpr Matrix(double m00, double m01, double m02, double m03,
+                     double m10, double m11, double m12, double m13,
+                     double m20, double m21, double m22, double m23)
+        : vals{{m00, m01, m02, m03}, {m10, m11, m12, m13}, {m20, m21, m22, m23}} {}
+
+    static constexpr Matrix identity() {
+        return Matrix();
     }
-    Matrix multiply(const Matrix &other) const {
-        Matrix mat(4);
-        assert(mat.sz == other.sz);
-        for (int i = 0; i < sz; i++) {
-            for (int j = 0; j < sz; j++) {
-                for (int k = 0; k < sz; k++) {
-                    mat.vals[i][j] += vals[i][k] * other.vals[k][j];
-                }
+    constexpr Matrix multiply(const Matrix &other) const {
+        Matrix mat;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                mat.vals[i][j] = vals[i][0] * other.vals[0][j] +
+                                 vals[i][1] * other.vals[1][j] +
+                                 vals[i][2] * other.vals[2][j];
             }
+            mat.vals[i][3] += vals[i][3];
         }
         return mat;
     }
-    Matrix inverse() const {
-        auto vals_copy = vals;
-        Matrix inv = Matrix::identity(sz);
-
-        // iterate through columns
-        for (int i = 0; i < sz; i++) {
-            // iterate through rows
-            int maxj = i;
-            for (int j = i + 1; j < sz; j++) {
-                if (fabs(vals_copy[j][i]) > fabs(vals_copy[maxj][i]))
-                    maxj = j;
-            }
-
-            swap(vals_copy[i], vals_copy[maxj]);
-            swap(inv[i], inv[maxj]);
-
-            double val = vals_copy[i][i];
-            for (int j = 0; j < sz; j++) {
-                vals_copy[i][j] /= val;
-                inv[i][j] /= val;
-            }
-
-            for (int j = i + 1; j < sz; j++) {
-                double coeff = vals_copy[j][i];
-                for (int k = 0; k < sz; k++) {
-                    vals_copy[j][k] -= coeff * vals_copy[i][k];
-                    inv[j][k] -= coeff * inv[i][k];
-                }
-            }
-        }
-
-        // iterate through columns
-        for (int i = sz - 1; i >= 0; i--) {
-            double coeff = vals_copy[i][i];
-            for (int j = 0; j < sz; j++) {
-                inv[i][j] /= coeff;
-            }
-            vals_copy[i][i] = 1.0;
+    constexpr Matrix operator*(const Matrix &other) const {
+        return multiply(other);
+    }
+    // Closed form: the linear block is inverted through its adjugate and
+    // the translation is taken back through that inverse.
+    constexpr Matrix inverse() const {
+        const double (&m)[4] = vals[0];
+        const double (&n)[4] = vals[1];
+        const double (&o)[4] = vals[2];
+        double c00 = n[1] * o[2] - n[2] * o[1];
+        double c01 = n[2] * o[0] - n[0] * o[2];
+        double c02 = n[0] * o[1] - n[1] * o[0];
+        double inv_det = 1.0 / (m[0] * c00 + m[1] * c01 + m[2] * c02);
 
-            // iterate through rows
-            for (int j = i - 1; j >= 0; j--) {
-                coeff = vals_copy[j][i];
-                vals_copy[j][i] = 0.0;
-                for (int k = 0; k < sz; k++) {
-                    inv[j][k] -= coeff * inv[i][k];
-                }
-            }
+        Matrix inv(
+            c00 * inv_det, (m[2] * o[1] - m[1] * o[2]) * inv_det, (m[1] * n[2] - m[2] * n[1]) * inv_det, 0.0,
+            c01 * inv_det, (m[0] * o[2] - m[2] * o[0]) * inv_det, (m[2] * n[0] - m[0] * n[2]) * inv_det, 0.0,
+            c02 * inv_det, (m[1] * o[0] - m[0] * o[1]) * inv_det, (m[0] * n[1] - m[1] * n[0]) * inv_det, 0.0);
+        for (int i = 0; i < 3; i++) {
+            inv.vals[i][3] = -(inv.vals[i][0] * m[3] + inv.vals[i][1] * n[3] + inv.vals[i][2] * o[3]);
         }
-
         return inv;
     }
-    Matrix transpose() {
-        Matrix ret(*this);
-        for (int i = 0; i < sz; i++) {
-            for (int j = 0; j < i; j++) {
-                swap(ret.vals[i][j], ret.vals[j][i]);
-            }
+    // M * (x, y, z, 1)
+    Vector apply(const Vector &vec) const {
+        return Vector(
+            vals[0][0] * vec.x + vals[0][1] * vec.y + vals[0][2] * vec.z + vals[0][3],
+            vals[1][0] * vec.x + vals[1][1] * vec.y + vals[1][2] * vec.z + vals[1][3],
+            vals[2][0] * vec.x + vals[2][1] * vec.y + vals[2][2] * vec.z + vals[2][3]
+        );
+    }
+    // M * (x, y, z, 0)
+    Vector apply_dir(const Vector &vec) const {
+        return Vector(
+            vals[0][0] * vec.x + vals[0][1] * vec.y + vals[0][2] * vec.z,
+            vals[1][0] * vec.x + vals[1][1] * vec.y + vals[1][2] * vec.z,
+            vals[2][0] * vec.x + vals[2][1] * vec.y + vals[2][2] * vec.z
+        );
+    }
+    // True if the linear block is a rotation (or reflection) times a
+    // uniform scale; *scale receives that scale.
+    bool uniform_scale(double *scale) const {
+        double len2[3];
+        for (int i = 0; i < 3; i++)
+            len2[i] = sqr(vals[0][i]) + sqr(vals[1][i]) + sqr(vals[2][i]);
+        double tol = 1e-12 * len2[0];
+        for (int i = 0; i < 3; i++) {
+            int j = (i + 1) % 3;
+            double dot = vals[0][i] * vals[0][j] + vals[1][i] * vals[1][j] + vals[2][i] * vals[2][j];
+            if (fabs(len2[i] - len2[0]) > tol || fabs(dot) > tol)
+                return false;
         }
-        return ret;
+        if (len2[0] <= 0.0)
+            return false;
+        *scale = sqrt(len2[0]);
+        return true;
+    }
+    constexpr double *operator[](int idx) {
+        return vals[idx];
     }
-    vector<double>& operator[](int idx) {
+    constexpr const double *operator[](int idx) const {
         return vals[idx];
     }
- 	vector<vector<double>> vals;
-    int sz;
+    friend ostream& operator<< (ostream &out, const Matrix &mat) {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                out << mat.vals[i][j] << " ";
+            }
+            out << endl;
+        }
+        out << "0 0 0 1 " << endl;
+        return out;
+    }
+    alignas(32) double vals[3][4];
 };
 
 #endif
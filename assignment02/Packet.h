@@ -0,0 +1,324 @@
+#ifndef __PACKET_H
+#define __PACKET_H
+
+#include <cmath>
+#include <cstring>
+#include <string>
+
+#include "BVH.h"
+#include "Matrix.h"
+#include "Vector.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PACKET_X86
+#endif
+
+class GeoObject;
+
+const int PACKET_DIM = 4;                        // packets cover 4x4 pixel blocks
+const int PACKET_SIZE = PACKET_DIM * PACKET_DIM;
+const unsigned PACKET_FULL = (1u << PACKET_SIZE) - 1;
+
+// Relative margin within which a single precision test counts as too close
+// to call (see RayPacket::uncertain), and the angular slack of frustum
+// culling. Both are far above float rounding.
+const float PACKET_TOL = 1e-3f;
+const double FRUSTUM_SLACK = 1e-4;
+
+/**
+ * Sixteen rays in structure-of-arrays single precision, lane k = row
+ * k / PACKET_DIM and column k % PACKET_DIM of the pixel block. `t` starts at
+ * INF and shrinks as kernels find closer hits, recording the object in `hit`.
+ *
+ * The rays are rounded to float, so a kernel only trusts a decision that
+ * is clear by PACKET_TOL. A ray that passes within that margin of an edge
+ * or silhouette, or finds two hits about as near, gets its bit set in
+ * `uncertain`, and the caller must trace it again in double precision.
+ *
+ * When every ray leaves from (a point along a ray from) a common apex, the
+ * four planes through the apex and the corner rays bound the whole packet;
+ * has_frustum is set and boxes entirely outside one plane can be culled
+ * without looking at the individual rays.
+ */
+struct RayPacket {
+    alignas(64) float ox[PACKET_SIZE];
+    alignas(64) float oy[PACKET_SIZE];
+    alignas(64) float oz[PACKET_SIZE];
+    alignas(64) float dx[PACKET_SIZE];
+    alignas(64) float dy[PACKET_SIZE];
+    alignas(64) float dz[PACKET_SIZE];
+    alignas(64) float ix[PACKET_SIZE];
+    alignas(64) float iy[PACKET_SIZE];
+    alignas(64) float iz[PACKET_SIZE];
+    alignas(64) float t[PACKET_SIZE];
+    GeoObject *hit[PACKET_SIZE];
+    unsigned active;
+    unsigned uncertain;
+    bool has_frustum;
+    Vector apex;
+    Vector planes[4];
+
+    void clear() {
+        active = 0;
+        uncertain = 0;
+        has_frustum = false;
+        for (int k = 0; k < PACKET_SIZE; k++) {
+            ox[k] = oy[k] = oz[k] = 0.0f;
+            dx[k] = dy[k] = dz[k] = 1.0f;
+            ix[k] = iy[k] = iz[k] = 1.0f;
+            t[k] = INF;
+            hit[k] = nullptr;
+        }
+    }
+    void set(int k, const Vector &pos, const Vector &dir) {
+        ox[k] = pos.x;
+        oy[k] = pos.y;
+        oz[k] = pos.z;
+        dx[k] = dir.x;
+        dy[k] = dir.y;
+        dz[k] = dir.z;
+        ix[k] = 1.0f / dx[k];
+        iy[k] = 1.0f / dy[k];
+        iz[k] = 1.0f / dz[k];
+        active |= 1u << k;
+    }
+    Vector dir(int k) const {
+        return Vector(dx[k], dy[k], dz[k]);
+    }
+    // The active rays taken through an affine map, e.g. into an object's
+    // space, with their current t. Directions are not renormalized, so t
+    // measures the same points in both spaces. No frustum is built.
+    RayPacket transformed(const Matrix &m) const {
+        RayPacket local;
+        local.clear();
+        for (int k = 0; k < PACKET_SIZE; k++) {
+            if (!((active >> k) & 1))
+                continue;
+            local.set(k, m.apply(Vector(ox[k], oy[k], oz[k])), m.apply_dir(dir(k)));
+            local.t[k] = t[k];
+        }
+        return local;
+    }
+    // Builds the corner-ray frustum; gives up (has_frustum stays false) for
+    // partial packets or if any ray falls outside it.
+    void build_frustum(const Vector &apex_) {
+        has_frustum = false;
+        if (active != PACKET_FULL)
+            return;
+        apex = apex_;
+        const int corners[4] = {0, PACKET_DIM - 1, PACKET_SIZE - 1, PACKET_SIZE - PACKET_DIM};
+        for (int i = 0; i < 4; i++) {
+            Vector a = dir(corners[i]);
+            planes[i] = a.cross(dir(corners[(i + 1) % 4]));
+            if (planes[i].dot(dir(corners[(i + 2) % 4])) < 0.0)
+                planes[i] = -planes[i];
+        }
+        for (int k = 0; k < PACKET_SIZE; k++) {
+            for (int i = 0; i < 4; i++) {
+                if (planes[i].dot(dir(k)) < -0.1 * FRUSTUM_SLACK * planes[i].norm())
+                    return;
+            }
+        }
+        has_frustum = true;
+    }
+    bool frustum_culls(const AABB &box) const {
+        if (!has_frustum)
+            return false;
+        for (int i = 0; i < 4; i++) {
+            const Vector &n = planes[i];
+            Vector corner(n.x >= 0.0 ? box.hi.x : box.lo.x,
+                          n.y >= 0.0 ? box.hi.y : box.lo.y,
+                          n.z >= 0.0 ? box.hi.z : box.lo.z);
+            Vector d = corner - apex;
+            if (n.dot(d) < -FRUSTUM_SLACK * n.norm() * d.norm())
+                return true;
+        }
+        return false;
+    }
+};
+
+/**
+ * One instruction set's packet kernels. `lanes` rays share a register, so a
+ * packet is processed as PACKET_SIZE / lanes chunks.
+ */
+struct PacketKernels {
+    const char *isa;
+    int lanes;
+    // Mask of rays in `active` whose segment [0, t] overlaps the box, and
+    // the nearest entry distance among them.
+    unsigned (*box)(const RayPacket &p, const float lo[3], const float hi[3],
+                    unsigned active, float *t_near);
+    void (*sphere)(RayPacket &p, const float center[3], float radius2, GeoObject *obj);
+    void (*triangle)(RayPacket &p, const float v0[3], const float e1[3],
+                     const float e2[3], GeoObject *obj);
+};
+
+namespace packet_sse {
+#define ISA_NAME "sse"
+const int W = 4;
+typedef float vf __attribute__((vector_size(16)));
+typedef int vi __attribute__((vector_size(16)));
+#ifdef PACKET_X86
+static inline vf vsqrt(vf x) { return _mm_sqrt_ps(x); }
+#else
+static inline vf vsqrt(vf x) {
+    for (int i = 0; i < W; i++)
+        x[i] = sqrtf(x[i]);
+    return x;
+}
+#endif
+#include "PacketKernels.inc"
+#undef ISA_NAME
+}
+
+#ifdef PACKET_X86
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace packet_avx2 {
+#define ISA_NAME "avx2"
+const int W = 8;
+typedef float vf __attribute__((vector_size(32)));
+typedef int vi __attribute__((vector_size(32)));
+static inline vf vsqrt(vf x) { return _mm256_sqrt_ps(x); }
+#include "PacketKernels.inc"
+#undef ISA_NAME
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+namespace packet_avx512 {
+#define ISA_NAME "avx512"
+const int W = 16;
+typedef float vf __attribute__((vector_size(64)));
+typedef int vi __attribute__((vector_size(64)));
+static inline vf vsqrt(vf x) { return _mm512_mask_sqrt_ps(x, (__mmask16)-1, x); }
+#include "PacketKernels.inc"
+#undef ISA_NAME
+}
+#pragma GCC pop_options
+#endif
+
+// Best kernels the running CPU supports.
+inline const PacketKernels *detect_packet_kernels() {
+#ifdef PACKET_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return &packet_avx512::kernels;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return &packet_avx2::kernels;
+#endif
+    return &packet_sse::kernels;
+}
+
+inline const PacketKernels *&active_packet_kernels() {
+    static const PacketKernels *kernels = detect_packet_kernels();
+    return kernels;
+}
+
+inline const PacketKernels &packet_kernels() {
+    return *active_packet_kernels();
+}
+
+// Forces a narrower instruction set by name; fails if the CPU lacks it.
+inline bool select_packet_isa(const string &isa) {
+    const PacketKernels *best = detect_packet_kernels();
+    const PacketKernels *choices[] = {
+        &packet_sse::kernels,
+#ifdef PACKET_X86
+        &packet_avx2::kernels,
+        &packet_avx512::kernels,
+#endif
+    };
+    for (auto choice : choices) {
+        if (isa == choice->isa && choice->lanes <= best->lanes) {
+            active_packet_kernels() = choice;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Packet version of BVH::traverse: visits every leaf that some active ray
+ * of the packet may hit, skipping nodes outside the packet frustum before
+ * testing the rays individually. Boxes are widened by PACKET_TOL of their
+ * coordinates and rounded outward to float, so the float rays never cull
+ * a box the double ones would enter.
+ */
+template <class F>
+void traverse_packet(const BVH &bvh, RayPacket &packet, F visit) {
+    if (bvh.empty() || !packet.active)
+        return;
+    const PacketKernels &kernels = packet_kernels();
+    struct Entry {
+        int node;
+        float t_near;
+    };
+    Entry stack[BVH::MAX_DEPTH + 1];
+    int top = 0;
+
+    auto test = [&](int idx, float *t_near) {
+        const AABB &box = bvh.nodes[idx].box;
+        if (packet.frustum_culls(box))
+            return false;
+        const double dlo[3] = {box.lo.x, box.lo.y, box.lo.z};
+        const double dhi[3] = {box.hi.x, box.hi.y, box.hi.z};
+        float lo[3], hi[3];
+        for (int a = 0; a < 3; a++) {
+            double pad = PACKET_TOL * (1.0 + max(fabs(dlo[a]), fabs(dhi[a])));
+            lo[a] = dlo[a] - pad;
+            hi[a] = dhi[a] + pad;
+            if (lo[a] > dlo[a] - pad)
+                lo[a] = nextafterf(lo[a], -INFINITY);
+            if (hi[a] < dhi[a] + pad)
+                hi[a] = nextafterf(hi[a], INFINITY);
+        }
+        return kernels.box(packet, lo, hi, packet.active, t_near) != 0;
+    };
+    auto farthest = [&]() {
+        float t_max = 0.0f;
+        for (int k = 0; k < PACKET_SIZE; k++) {
+            if ((packet.active >> k) & 1)
+                t_max = max(t_max, packet.t[k]);
+        }
+        return t_max;
+    };
+
+    float t_root;
+    if (!test(0, &t_root))
+        return;
+    stack[top++] = {0, t_root};
+    while (top > 0) {
+        Entry entry = stack[--top];
+        if (entry.t_near > farthest())
+            continue;
+        const BVH::Node &node = bvh.nodes[entry.node];
+        if (node.count > 0) {
+            for (int i = node.offset; i < node.offset + node.count; i++)
+                visit(bvh.prim_ids[i]);
+            continue;
+        }
+        int left = entry.node + 1;
+        int right = node.offset;
+        float t_left, t_right;
+        bool hit_left = test(left, &t_left);
+        bool hit_right = test(right, &t_right);
+        if (hit_left && hit_right) {
+            if (t_left < t_right) {
+                stack[top++] = {right, t_right};
+                stack[top++] = {left, t_left};
+            } else {
+                stack[top++] = {left, t_left};
+                stack[top++] = {right, t_right};
+            }
+        } else if (hit_left) {
+            stack[top++] = {left, t_left};
+        } else if (hit_right) {
+            stack[top++] = {right, t_right};
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef __PRIMITIVES_H
+#define __PRIMITIVES_H
+
+#include <algorithm>
+#include <cstdint>
+#include <typeinfo>
+#include <vector>
+
+#include "BVH.h"
+#include "GeoObject.h"
+
+/**
+ * Scene object by type and position in that type's array. Four bytes, so
+ * a whole leaf's worth sits in a fraction of a cache line.
+ */
+struct PrimHandle {
+    enum Type { SPHERE, ELLIPSOID, TRIANGLE, OTHER };
+    static const int INDEX_BITS = 30;
+
+    PrimHandle() : bits(~0u) {}
+    PrimHandle(Type type, uint32_t index) : bits((uint32_t)type << INDEX_BITS | index) {}
+    Type type() const {
+        return (Type)(bits >> INDEX_BITS);
+    }
+    uint32_t index() const {
+        return bits & ((1u << INDEX_BITS) - 1);
+    }
+    bool valid() const {
+        return bits != ~0u;
+    }
+    uint32_t bits;
+};
+
+/**
+ * Scene objects stored by type.
+ *
+ * partition() moves every Sphere, Ellipsoid and Triangle of the scene into
+ * a contiguous array of its type, in the order the world BVH's leaves
+ * reach them, and sorts each leaf's primitives by type. A leaf is then a
+ * few runs, each a contiguous slice of one array, and each run is tested
+ * by a loop instantiated for its type whose calls are bound at compile
+ * time. Everything else (mesh instances, keyframed objects) stays behind
+ * its pointer and goes through the virtual interface.
+ */
+class PrimitiveArrays {
+ public:
+    PrimitiveArrays() = default;
+    PrimitiveArrays(const PrimitiveArrays &) = delete;
+    PrimitiveArrays &operator=(const PrimitiveArrays &) = delete;
+    ~PrimitiveArrays() {
+        clear();
+    }
+
+    static PrimHandle::Type type_of(GeoObject *obj) {
+        const std::type_info &type = typeid(*obj);
+        if (type == typeid(Sphere))
+            return PrimHandle::SPHERE;
+        if (type == typeid(Ellipsoid))
+            return PrimHandle::ELLIPSOID;
+        if (type == typeid(Triangle))
+            return PrimHandle::TRIANGLE;
+        return PrimHandle::OTHER;
+    }
+
+    /**
+     * Takes ownership of objects, which bvh must have been built over.
+     * Each objects[i] is repointed to the object's new home, so code
+     * that walks objects keeps working, and bvh's leaves are reordered by
+     * type.
+     */
+    void partition(vector<GeoObject *> &objects, BVH &bvh) {
+        clear();
+        for (auto &node : bvh.nodes) {
+            if (node.count == 0)
+                continue;
+            auto leaf = bvh.prim_ids.begin() + node.offset;
+            stable_sort(leaf, leaf + node.count, [&](int a, int b) {
+                return type_of(objects[a]) < type_of(objects[b]);
+            });
+        }
+        size_t counts[4] = {};
+        for (GeoObject *obj : objects)
+            counts[type_of(obj)]++;
+        spheres.reserve(counts[PrimHandle::SPHERE]);
+        ellipsoids.reserve(counts[PrimHandle::ELLIPSOID]);
+        triangles.reserve(counts[PrimHandle::TRIANGLE]);
+        others.reserve(counts[PrimHandle::OTHER]);
+
+        leaf_handles.resize(bvh.prim_ids.size());
+        for (size_t i = 0; i < bvh.prim_ids.size(); i++) {
+            GeoObject *obj = objects[bvh.prim_ids[i]];
+            PrimHandle::Type type = type_of(obj);
+            switch (type) {
+            case PrimHandle::SPHERE:
+                leaf_handles[i] = PrimHandle(type, spheres.size());
+                spheres.push_back(*static_cast<Sphere *>(obj));
+                break;
+            case PrimHandle::ELLIPSOID:
+                leaf_handles[i] = PrimHandle(type, ellipsoids.size());
+                ellipsoids.push_back(*static_cast<Ellipsoid *>(obj));
+                break;
+            case PrimHandle::TRIANGLE:
+                leaf_handles[i] = PrimHandle(type, triangles.size());
+                triangles.push_back(*static_cast<Triangle *>(obj));
+                break;
+            default:
+                leaf_handles[i] = PrimHandle(type, others.size());
+                others.push_back(obj);
+                break;
+            }
+        }
+        for (size_t i = 0; i < bvh.prim_ids.size(); i++) {
+            GeoObject *&obj = objects[bvh.prim_ids[i]];
+            GeoObject *home = object(leaf_handles[i]);
+            if (home != obj) {
+                delete obj;
+                obj = home;
+            }
+        }
+    }
+
+    void clear() {
+        for (GeoObject *obj : others)
+            delete obj;
+        others.clear();
+        spheres.clear();
+        ellipsoids.clear();
+        triangles.clear();
+        leaf_handles.clear();
+    }
+    bool empty() const {
+        return leaf_handles.empty();
+    }
+
+    GeoObject *object(PrimHandle handle) {
+        if (!handle.valid())
+            return nullptr;
+        switch (handle.type()) {
+        case PrimHandle::SPHERE:
+            return &spheres[handle.index()];
+        case PrimHandle::ELLIPSOID:
+            return &ellipsoids[handle.index()];
+        case PrimHandle::TRIANGLE:
+            return &triangles[handle.index()];
+        default:
+            return others[handle.index()];
+        }
+    }
+
+    // Closest hit in the BVH leaf [first, first + count) closer than *t;
+    // updates *t, *normal (unless null) and *hit.
+    void intersect_leaf(int first, int count, const Vector &ray_pos, const Vector &ray_dir,
+                        double *t, Vector *normal, PrimHandle *hit) {
+        for_each_run(first, count, [&](PrimHandle::Type type, uint32_t begin, uint32_t end) {
+            switch (type) {
+            case PrimHandle::SPHERE:
+                closest_hit(spheres.data(), type, begin, end, ray_pos, ray_dir, t, normal, hit);
+                break;
+            case PrimHandle::ELLIPSOID:
+                closest_hit(ellipsoids.data(), type, begin, end, ray_pos, ray_dir, t, normal, hit);
+                break;
+            case PrimHandle::TRIANGLE:
+                closest_hit(triangles.data(), type, begin, end, ray_pos, ray_dir, t, normal, hit);
+                break;
+            default:
+                for (uint32_t k = begin; k < end; k++) {
+                    if (others[k]->intersect(ray_pos, ray_dir, t, normal))
+                        *hit = PrimHandle(type, k);
+                }
+                break;
+            }
+            return false;
+        });
+    }
+
+    // True if anything in the BVH leaf [first, first + count) blocks the
+    // ray before t_max.
+    bool occluded_leaf(int first, int count, const Vector &ray_pos, const Vector &ray_dir, double t_max) {
+        return for_each_run(first, count, [&](PrimHandle::Type type, uint32_t begin, uint32_t end) {
+            switch (type) {
+            case PrimHandle::SPHERE:
+                return any_hit(spheres.data(), begin, end, ray_pos, ray_dir, t_max);
+            case PrimHandle::ELLIPSOID:
+                return any_hit(ellipsoids.data(), begin, end, ray_pos, ray_dir, t_max);
+            case PrimHandle::TRIANGLE:
+                return any_hit(triangles.data(), begin, end, ray_pos, ray_dir, t_max);
+            default:
+                for (uint32_t k = begin; k < end; k++) {
+                    if (others[k]->occluded(ray_pos, ray_dir, t_max))
+                        return true;
+                }
+                return false;
+            }
+        });
+    }
+
+    vector<Sphere> spheres;
+    vector<Ellipsoid> ellipsoids;
+    vector<Triangle> triangles;
+    vector<GeoObject *> others;     // owned
+    vector<PrimHandle> leaf_handles; // parallel to the BVH's prim_ids
+
+ private:
+    // Calls run(type, begin, end) for each run of one type in the leaf,
+    // [begin, end) indexing that type's array, until one returns true.
+    template <class F>
+    bool for_each_run(int first, int count, F run) const {
+        int last = first + count;
+        for (int i = first; i < last;) {
+            PrimHandle::Type type = leaf_handles[i].type();
+            int j = i + 1;
+            while (j < last && leaf_handles[j].type() == type)
+                j++;
+            uint32_t begin = leaf_handles[i].index();
+            if (run(type, begin, begin + (j - i)))
+                return true;
+            i = j;
+        }
+        return false;
+    }
+
+    // The qualified T:: calls are bound statically, so the loop body is
+    // the primitive's own test with no vtable lookup.
+    template <class T>
+    static void closest_hit(T *prims, PrimHandle::Type type, uint32_t begin, uint32_t end,
+                            const Vector &ray_pos, const Vector &ray_dir, double *t, Vector *normal,
+                            PrimHandle *hit) {
+        for (uint32_t k = begin; k < end; k++) {
+            if (prims[k].T::intersect(ray_pos, ray_dir, t, normal))
+                *hit = PrimHandle(type, k);
+        }
+    }
+    template <class T>
+    static bool any_hit(T *prims, uint32_t begin, uint32_t end,
+                        const Vector &ray_pos, const Vector &ray_dir, double t_max) {
+        for (uint32_t k = begin; k < end; k++) {
+            double t = t_max;
+            if (prims[k].T::intersect(ray_pos, ray_dir, &t, nullptr))
+                return true;
+        }
+        return false;
+    }
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef __RENDER_STATS_H
+#define __RENDER_STATS_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * Hot-path event counters for the renderer.
+ *
+ * Every thread increments its own cache-line aligned block, so counting
+ * needs no atomics or locks; merged() sums the blocks once rendering is
+ * done. Blocks of finished threads are kept, with their counts, and handed
+ * to the next new thread. Building with -DNO_RENDER_STATS turns add() into
+ * a no-op.
+ */
+namespace RenderStats {
+
+enum Counter {
+    PRIMARY_RAYS,
+    SHADOW_RAYS,
+    REFLECTION_RAYS,
+    PACKETS,
+    BVH_NODE_TESTS,
+    SPHERE_TESTS,
+    SPHERE_HITS,
+    ELLIPSOID_TESTS,
+    ELLIPSOID_HITS,
+    TRIANGLE_TESTS,
+    TRIANGLE_HITS,
+    MESH_FACE_TESTS,
+    MESH_FACE_HITS,
+    AABB_REJECTS,
+    CHUNK_HITS,
+    CHUNK_MISSES,
+    CHUNK_EVICTIONS,
+    NUM_COUNTERS
+};
+
+// Counter names as used in the JSON report, in Counter order.
+inline const char *name(int counter) {
+    static const char *names[NUM_COUNTERS] = {
+        "primary_rays", "shadow_rays", "reflection_rays", "packets", "bvh_node_tests",
+        "sphere_tests", "sphere_hits", "ellipsoid_tests", "ellipsoid_hits",
+        "triangle_tests", "triangle_hits", "mesh_face_tests", "mesh_face_hits",
+        "aabb_rejects", "chunk_hits", "chunk_misses", "chunk_evictions"};
+    return names[counter];
+}
+
+struct alignas(64) Block {
+    uint64_t count[NUM_COUNTERS] = {};
+};
+
+struct Registry {
+    std::mutex lock;
+    std::vector<std::unique_ptr<Block>> blocks;
+    std::vector<Block *> free_blocks;
+};
+
+inline Registry &registry() {
+    static Registry reg;
+    return reg;
+}
+
+// Owns the calling thread's claim on a block and returns it on exit.
+struct ThreadBlock {
+    ThreadBlock() {
+        Registry &reg = registry();
+        std::lock_guard<std::mutex> guard(reg.lock);
+        if (!reg.free_blocks.empty()) {
+            block = reg.free_blocks.back();
+            reg.free_blocks.pop_back();
+        } else {
+            reg.blocks.emplace_back(new Block);
+            block = reg.blocks.back().get();
+        }
+    }
+    ~ThreadBlock() {
+        Registry &reg = registry();
+        std::lock_guard<std::mutex> guard(reg.lock);
+        reg.free_blocks.push_back(block);
+    }
+    Block *block;
+};
+
+inline Block *claim_block() {
+    thread_local ThreadBlock owner;
+    return owner.block;
+}
+
+inline void add(Counter counter, uint64_t n = 1) {
+#ifndef NO_RENDER_STATS
+    // A plain pointer needs no per-access initialization guard, unlike
+    // the ThreadBlock behind it.
+    thread_local Block *block = nullptr;
+    if (!block)
+        block = claim_block();
+    block->count[counter] += n;
+#endif
+}
+
+// Sum over all threads. Call while no thread is counting.
+inline Block merged() {
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> guard(reg.lock);
+    Block total;
+    for (auto &block : reg.blocks) {
+        for (int i = 0; i < NUM_COUNTERS; i++)
+            total.count[i] += block->count[i];
+    }
+    return total;
+}
+
+}  // namespace RenderStats
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef __SAMPLER_H
+#define __SAMPLER_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "Vector.h"
+
+/**
+ * Sub-pixel sample positions and per-pixel sample statistics for adaptive
+ * anti-aliasing.
+ *
+ * Sample 0 is the pixel center, so one sample per pixel reproduces the
+ * plain renderer. Later samples follow the 2D Halton sequence (bases 2 and
+ * 3), shifted by a per-pixel offset (Cranley-Patterson rotation) so
+ * neighbouring pixels do not share one sample pattern.
+ */
+namespace Sampler {
+
+inline double radical_inverse(uint32_t index, uint32_t base) {
+    double inv_base = 1.0 / base, f = inv_base, result = 0.0;
+    while (index > 0) {
+        result += f * (index % base);
+        index /= base;
+        f *= inv_base;
+    }
+    return result;
+}
+
+inline uint32_t hash_bits(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+inline double hash_unit(uint32_t x) {
+    return hash_bits(x) * (1.0 / 4294967296.0);
+}
+
+// Number in [0, 1) fixed by the ray alone, so a random choice about it
+// comes out the same on every thread, worker and resumed run.
+inline double ray_unit(const Vector &pos, const Vector &dir) {
+    double parts[6] = {pos.x, pos.y, pos.z, dir.x, dir.y, dir.z};
+    uint32_t h = 0;
+    for (double part : parts) {
+        uint64_t bits;
+        memcpy(&bits, &part, sizeof(bits));
+        h = hash_bits(h ^ (uint32_t)bits);
+        h = hash_bits(h ^ (uint32_t)(bits >> 32));
+    }
+    return h * (1.0 / 4294967296.0);
+}
+
+// Offset of sample k inside pixel (x, y), each coordinate in [0, 1).
+inline void offset(int x, int y, int k, double *du, double *dv) {
+    if (k == 0) {
+        *du = *dv = 0.5;
+        return;
+    }
+    uint32_t seed = (uint32_t)x * 73856093U ^ (uint32_t)y * 19349663U;
+    *du = radical_inverse(k, 2) + hash_unit(seed);
+    *dv = radical_inverse(k, 3) + hash_unit(seed + 0x9e3779b9U);
+    *du -= floor(*du);
+    *dv -= floor(*dv);
+}
+
+inline double luminance(const Vector &c) {
+    return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z;
+}
+
+// Running mean color and luminance variance of one pixel (Welford).
+struct PixelEstimate {
+    void add(const Vector &color) {
+        count++;
+        sum = sum + color;
+        double lum = luminance(color);
+        double delta = lum - lum_mean;
+        lum_mean += delta / count;
+        lum_m2 += delta * (lum - lum_mean);
+    }
+    Vector mean() const {
+        return count > 0 ? sum / count : Vector();
+    }
+    // Standard error of the mean luminance.
+    double std_error() const {
+        return count > 1 ? sqrt(lum_m2 / (count - 1) / count) : 0.0;
+    }
+    Vector sum;
+    double lum_mean = 0.0;
+    double lum_m2 = 0.0;
+    int count = 0;
+};
+
+}  // namespace Sampler
+
+#endif
@@ -0,0 +1,563 @@
+#ifndef __SCENE_CACHE_H
+#define __SCENE_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BVH.h"
+#include "Camera.h"
+#include "ChunkedMesh.h"
+#include "GeoObject.h"
+#include "Light.h"
+#include "MappedFile.h"
+#include "Material.h"
+#include "TriangleMesh.h"
+
+/**
+ * Compiled scenes.
+ *
+ * write() stores a parsed scene in one binary file: the render settings,
+ * camera, material table, lights, every object and loaded mesh, and the
+ * built world BVH. read() maps the file and rebuilds the scene from it
+ * without parsing text or .obj files, building BVHs or inverting
+ * matrices. The objects of each type sit in one array of fixed-size
+ * records, the meshes' vertex, face and BVH arrays are stored exactly as
+ * they are held in memory, and every section starts 64-byte aligned, so
+ * loading is a handful of bulk copies out of the mapping.
+ *
+ * Out-of-core meshes are stored as the path of their .chunks file.
+ * Keyframed objects cannot be compiled.
+ */
+namespace SceneCache {
+
+const uint32_t MAGIC = 0x43535452; // "RTSC"
+const uint32_t VERSION = 1;
+const size_t ALIGN = 64;
+
+enum Section {
+    MATERIALS,
+    LIGHTS,
+    SPHERES,
+    ELLIPSOIDS,
+    TRIANGLES,
+    INSTANCES,
+    OBJECTS,
+    MESHES,
+    WORLD_NODES,
+    WORLD_PRIMS,
+    NUM_SECTIONS
+};
+
+struct Span {
+    uint64_t offset, count;
+};
+
+struct Settings {
+    int32_t width, height, depth;
+    int32_t crop[4];
+};
+
+struct Header {
+    uint32_t magic, version;
+    Settings settings;
+    int32_t pad;
+    double camera[15];
+    Span sections[NUM_SECTIONS];
+};
+
+struct MaterialRecord {
+    double ambient[3], diffuse[3], specular[3], sp_k, reflective[3];
+    int32_t max_bounces, pad;
+};
+
+enum LightType { AMBIENT, POINT, SPOT, DIRECTIONAL };
+
+struct LightRecord {
+    int32_t type, falloff;
+    double vec[3], color[3], dir[3];
+    double beam_angle, falloff_angle; // radians
+};
+
+struct SphereRecord {
+    double center[3], radius;
+    uint32_t mtrl, pad;
+};
+
+struct EllipsoidRecord {
+    double center[3], radius;
+    double to_world[12], to_object[12], normal_mat[12];
+    double lo[3], hi[3];
+    uint32_t mtrl, pad;
+};
+
+struct TriangleRecord {
+    double a[3], e1[3], e2[3], normal[3];
+    uint32_t mtrl, pad;
+};
+
+struct InstanceRecord {
+    double to_world[12], to_object[12], normal_mat[12];
+    double lo[3], hi[3];
+    int32_t mesh;
+    uint32_t mtrl;
+};
+
+enum ObjectType { SPHERE, ELLIPSOID, TRIANGLE, INSTANCE };
+
+// Position of one scene object in its type's array; the OBJECTS section
+// lists them in scene order, which the world BVH's ids refer to.
+struct ObjectRef {
+    int32_t type, index;
+};
+
+struct MeshRecord {
+    int32_t chunked, pad;
+    uint64_t num_vertices, num_faces, num_nodes;
+    // offsets of the arrays; a chunked mesh has only its path
+    uint64_t xs, ys, zs, faces, nodes, prim_ids;
+    uint64_t path, path_bytes;
+};
+
+struct NodeRecord {
+    double lo[3], hi[3];
+    int32_t offset, count;
+};
+
+inline void put(double *out, const Vector &v) {
+    out[0] = v.x;
+    out[1] = v.y;
+    out[2] = v.z;
+}
+inline Vector get(const double *in) {
+    return Vector(in[0], in[1], in[2]);
+}
+inline void put(double *out, const Matrix &m) {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++)
+            out[4 * i + j] = m[i][j];
+    }
+}
+inline Matrix get_matrix(const double *in) {
+    return Matrix(in[0], in[1], in[2], in[3], in[4], in[5], in[6], in[7], in[8], in[9], in[10], in[11]);
+}
+inline vector<NodeRecord> put_nodes(const BVH &bvh) {
+    vector<NodeRecord> records(bvh.nodes.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        put(records[i].lo, bvh.nodes[i].box.lo);
+        put(records[i].hi, bvh.nodes[i].box.hi);
+        records[i].offset = bvh.nodes[i].offset;
+        records[i].count = bvh.nodes[i].count;
+    }
+    return records;
+}
+// Fills bvh from the records; false if a child, leaf range or primitive id
+// lies outside the arrays (prim ids must index num_items primitives).
+inline bool get_nodes(const NodeRecord *records, size_t n, const int *prim_ids, size_t num_prims,
+                      size_t num_items, BVH *bvh) {
+    bvh->nodes.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        BVH::Node &node = bvh->nodes[i];
+        node.box = AABB(get(records[i].lo), get(records[i].hi));
+        node.offset = records[i].offset;
+        node.count = records[i].count;
+        bool ok;
+        if (node.count > 0)
+            ok = node.offset >= 0 && (size_t)node.offset + node.count <= num_prims;
+        else // children come after their parent, so traversal cannot loop
+            ok = node.count == 0 && i + 1 < n && node.offset > (int64_t)i && (size_t)node.offset < n;
+        if (!ok)
+            return false;
+    }
+    for (size_t i = 0; i < num_prims; i++) {
+        if (prim_ids[i] < 0 || (size_t)prim_ids[i] >= num_items)
+            return false;
+    }
+    bvh->prim_ids.assign(prim_ids, prim_ids + num_prims);
+    return true;
+}
+
+// Appends sections to a file, each at the next ALIGN boundary.
+class Writer {
+ public:
+    explicit Writer(FILE *f_) : f(f_) {}
+    uint64_t append(const void *data, size_t bytes) {
+        static const char zeros[ALIGN] = {};
+        size_t pad = (ALIGN - pos % ALIGN) % ALIGN;
+        ok = ok && fwrite(zeros, 1, pad, f) == pad && (bytes == 0 || fwrite(data, 1, bytes, f) == bytes);
+        pos += pad;
+        uint64_t at = pos;
+        pos += bytes;
+        return at;
+    }
+    template <class T>
+    Span append(const vector<T> &items) {
+        Span span = {append(items.data(), items.size() * sizeof(T)), items.size()};
+        return span;
+    }
+    FILE *f;
+    uint64_t pos = 0;
+    bool ok = true;
+};
+
+inline bool is_compiled(const std::string &path) {
+    uint32_t magic = 0;
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+    bool ok = fread(&magic, sizeof(magic), 1, f) == 1 && magic == MAGIC;
+    fclose(f);
+    return ok;
+}
+
+/**
+ * Writes the scene to path. The objects must be spheres, ellipsoids,
+ * triangles or mesh instances, and bvh built over them. Returns false if
+ * the file cannot be written.
+ */
+inline bool write(const std::string &path, const Settings &settings, const vector<GeoObject *> &objects,
+                  const vector<Light *> &lights, const BVH &bvh) {
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = MAGIC;
+    header.version = VERSION;
+    header.settings = settings;
+    Camera *cam = Camera::instance();
+    const Vector *corners[5] = {&cam->loc, &cam->ll, &cam->lr, &cam->ul, &cam->ur};
+    for (int i = 0; i < 5; i++)
+        put(header.camera + 3 * i, *corners[i]);
+
+    vector<MaterialRecord> materials;
+    for (const Material &m : MaterialTable::instance().materials) {
+        MaterialRecord r;
+        memset(&r, 0, sizeof(r));
+        put(r.ambient, m.ambient);
+        put(r.diffuse, m.diffuse);
+        put(r.specular, m.specular);
+        r.sp_k = m.sp_k;
+        put(r.reflective, m.reflective);
+        r.max_bounces = m.max_bounces;
+        materials.push_back(r);
+    }
+
+    vector<LightRecord> light_records;
+    for (Light *light : lights) {
+        LightRecord r;
+        memset(&r, 0, sizeof(r));
+        put(r.vec, light->vec);
+        put(r.color, light->color);
+        r.falloff = light->falloff;
+        if (SpotLight *spot = dynamic_cast<SpotLight *>(light)) {
+            r.type = SPOT;
+            put(r.dir, spot->dir);
+            r.beam_angle = spot->beamAngle;
+            r.falloff_angle = spot->falloffAngle;
+        } else if (dynamic_cast<PointLight *>(light)) {
+            r.type = POINT;
+        } else if (dynamic_cast<DirectionalLight *>(light)) {
+            r.type = DIRECTIONAL;
+        } else {
+            r.type = AMBIENT;
+        }
+        light_records.push_back(r);
+    }
+
+    vector<SphereRecord> spheres;
+    vector<EllipsoidRecord> ellipsoids;
+    vector<TriangleRecord> triangles;
+    vector<InstanceRecord> instances;
+    vector<ObjectRef> refs;
+    vector<GeoObject *> meshes;
+    for (GeoObject *obj : objects) {
+        ObjectRef ref;
+        if (Ellipsoid *e = dynamic_cast<Ellipsoid *>(obj)) {
+            EllipsoidRecord r;
+            memset(&r, 0, sizeof(r));
+            put(r.center, e->center);
+            r.radius = e->radius;
+            put(r.to_world, e->to_world);
+            put(r.to_object, e->to_object);
+            put(r.normal_mat, e->normal_mat);
+            put(r.lo, e->world_bounds.lo);
+            put(r.hi, e->world_bounds.hi);
+            r.mtrl = e->mtrl_id;
+            ref = ObjectRef{ELLIPSOID, (int32_t)ellipsoids.size()};
+            ellipsoids.push_back(r);
+        } else if (Sphere *s = dynamic_cast<Sphere *>(obj)) {
+            SphereRecord r;
+            memset(&r, 0, sizeof(r));
+            put(r.center, s->center);
+            r.radius = s->radius;
+            r.mtrl = s->mtrl_id;
+            ref = ObjectRef{SPHERE, (int32_t)spheres.size()};
+            spheres.push_back(r);
+        } else if (Triangle *t = dynamic_cast<Triangle *>(obj)) {
+            TriangleRecord r;
+            memset(&r, 0, sizeof(r));
+            put(r.a, t->a);
+            put(r.e1, t->e1);
+            put(r.e2, t->e2);
+            put(r.normal, t->normal);
+            r.mtrl = t->mtrl_id;
+            ref = ObjectRef{TRIANGLE, (int32_t)triangles.size()};
+            triangles.push_back(r);
+        } else if (MeshInstance *inst = dynamic_cast<MeshInstance *>(obj)) {
+            InstanceRecord r;
+            memset(&r, 0, sizeof(r));
+            put(r.to_world, inst->to_world);
+            put(r.to_object, inst->to_object);
+            put(r.normal_mat, inst->normal_mat);
+            put(r.lo, inst->world_bounds.lo);
+            put(r.hi, inst->world_bounds.hi);
+            r.mtrl = inst->mtrl_id;
+            r.mesh = find(meshes.begin(), meshes.end(), inst->mesh.get()) - meshes.begin();
+            if (r.mesh == (int32_t)meshes.size())
+                meshes.push_back(inst->mesh.get());
+            ref = ObjectRef{INSTANCE, (int32_t)instances.size()};
+            instances.push_back(r);
+        } else {
+            return false;
+        }
+        refs.push_back(ref);
+    }
+
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+    Writer out(f);
+    out.append(&header, sizeof(header));
+    vector<MeshRecord> mesh_records;
+    for (GeoObject *mesh : meshes) {
+        MeshRecord r;
+        memset(&r, 0, sizeof(r));
+        if (ChunkedMesh *chunked = dynamic_cast<ChunkedMesh *>(mesh)) {
+            r.chunked = 1;
+            r.path = out.append(chunked->path.data(), chunked->path.size());
+            r.path_bytes = chunked->path.size();
+        } else {
+            TriangleMesh *tm = static_cast<TriangleMesh *>(mesh);
+            r.num_vertices = tm->num_vertices();
+            r.num_faces = tm->num_faces();
+            r.num_nodes = tm->bvh.nodes.size();
+            r.xs = out.append(tm->xs).offset;
+            r.ys = out.append(tm->ys).offset;
+            r.zs = out.append(tm->zs).offset;
+            r.faces = out.append(tm->faces).offset;
+            r.nodes = out.append(put_nodes(tm->bvh)).offset;
+            r.prim_ids = out.append(tm->bvh.prim_ids).offset;
+        }
+        mesh_records.push_back(r);
+    }
+    header.sections[MATERIALS] = out.append(materials);
+    header.sections[LIGHTS] = out.append(light_records);
+    header.sections[SPHERES] = out.append(spheres);
+    header.sections[ELLIPSOIDS] = out.append(ellipsoids);
+    header.sections[TRIANGLES] = out.append(triangles);
+    header.sections[INSTANCES] = out.append(instances);
+    header.sections[OBJECTS] = out.append(refs);
+    header.sections[MESHES] = out.append(mesh_records);
+    header.sections[WORLD_NODES] = out.append(put_nodes(bvh));
+    header.sections[WORLD_PRIMS] = out.append(bvh.prim_ids);
+    bool ok = out.ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Loads a scene written by write(): sets the camera and material table and
+ * appends to objects and lights. The material table must still be fresh.
+ * On failure *error says why.
+ */
+inline bool read(const std::string &path, Settings *settings, vector<GeoObject *> *objects,
+                 vector<Light *> *lights, BVH *bvh, std::string *error) {
+    MappedFile file(path);
+    if (!file.is_open() || file.size < sizeof(Header)) {
+        *error = "cannot read file";
+        return false;
+    }
+    Header header;
+    memcpy(&header, file.data, sizeof(header));
+    if (header.magic != MAGIC || header.version != VERSION) {
+        *error = "not a compiled scene of version " + std::to_string(VERSION);
+        return false;
+    }
+    // Pointer to n items of T at offset, if they lie inside the file.
+    bool in_bounds = true;
+    auto at = [&](uint64_t offset, uint64_t n, size_t item) -> const char * {
+        if (offset > file.size || n > (file.size - offset) / item) {
+            in_bounds = false;
+            return nullptr;
+        }
+        return file.data + offset;
+    };
+    auto section = [&](Section s, size_t item) {
+        return at(header.sections[s].offset, header.sections[s].count, item);
+    };
+    auto count = [&](Section s) {
+        return header.sections[s].count;
+    };
+
+    *settings = header.settings;
+    const double *c = header.camera;
+    Camera::instance()->init(c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7], c[8],
+                             c[9], c[10], c[11], c[12], c[13], c[14]);
+
+    const MaterialRecord *materials = (const MaterialRecord *)section(MATERIALS, sizeof(MaterialRecord));
+    for (uint64_t i = 0; in_bounds && i < count(MATERIALS); i++) {
+        const MaterialRecord &r = materials[i];
+        Material m(r.ambient[0], r.ambient[1], r.ambient[2], r.diffuse[0], r.diffuse[1], r.diffuse[2],
+                   r.specular[0], r.specular[1], r.specular[2], r.sp_k,
+                   r.reflective[0], r.reflective[1], r.reflective[2]);
+        m.max_bounces = r.max_bounces;
+        if (MaterialTable::instance().intern(m) != i) {
+            *error = "material table does not match";
+            return false;
+        }
+    }
+
+    const LightRecord *light_records = (const LightRecord *)section(LIGHTS, sizeof(LightRecord));
+    for (uint64_t i = 0; in_bounds && i < count(LIGHTS); i++) {
+        const LightRecord &r = light_records[i];
+        Light *light;
+        if (r.type == SPOT) {
+            SpotLight *spot = new SpotLight(r.vec[0], r.vec[1], r.vec[2], r.dir[0], r.dir[1], r.dir[2],
+                                            r.color[0], r.color[1], r.color[2], 0.0, 0.0);
+            spot->beamAngle = r.beam_angle;
+            spot->falloffAngle = r.falloff_angle;
+            light = spot;
+        } else if (r.type == POINT) {
+            light = new PointLight(r.vec[0], r.vec[1], r.vec[2], r.color[0], r.color[1], r.color[2], r.falloff);
+        } else if (r.type == DIRECTIONAL) {
+            light = new DirectionalLight(r.vec[0], r.vec[1], r.vec[2], r.color[0], r.color[1], r.color[2]);
+            light->vec = get(r.vec); // already normalized when compiled
+        } else {
+            light = new AmbientLight(r.color[0], r.color[1], r.color[2]);
+        }
+        lights->push_back(light);
+    }
+
+    vector<shared_ptr<GeoObject>> meshes;
+    const MeshRecord *mesh_records = (const MeshRecord *)section(MESHES, sizeof(MeshRecord));
+    for (uint64_t i = 0; in_bounds && i < count(MESHES); i++) {
+        const MeshRecord &r = mesh_records[i];
+        if (r.chunked) {
+            const char *p = at(r.path, r.path_bytes, 1);
+            auto mesh = make_shared<ChunkedMesh>();
+            if (!in_bounds || !mesh->open(std::string(p, r.path_bytes))) {
+                *error = "cannot open mesh chunks " + std::string(p ? p : "", p ? r.path_bytes : 0);
+                return false;
+            }
+            meshes.push_back(mesh);
+            continue;
+        }
+        const double *xs = (const double *)at(r.xs, r.num_vertices, sizeof(double));
+        const double *ys = (const double *)at(r.ys, r.num_vertices, sizeof(double));
+        const double *zs = (const double *)at(r.zs, r.num_vertices, sizeof(double));
+        const TriangleMesh::Face *faces = (const TriangleMesh::Face *)at(r.faces, r.num_faces, sizeof(TriangleMesh::Face));
+        const NodeRecord *nodes = (const NodeRecord *)at(r.nodes, r.num_nodes, sizeof(NodeRecord));
+        const int *prim_ids = (const int *)at(r.prim_ids, r.num_faces, sizeof(int));
+        if (!in_bounds)
+            break;
+        auto mesh = make_shared<TriangleMesh>();
+        mesh->xs.assign(xs, xs + r.num_vertices);
+        mesh->ys.assign(ys, ys + r.num_vertices);
+        mesh->zs.assign(zs, zs + r.num_vertices);
+        mesh->faces.assign(faces, faces + r.num_faces);
+        for (const TriangleMesh::Face &face : mesh->faces) {
+            if (face.v[0] >= r.num_vertices || face.v[1] >= r.num_vertices || face.v[2] >= r.num_vertices) {
+                *error = "bad vertex index";
+                return false;
+            }
+        }
+        if (!get_nodes(nodes, r.num_nodes, prim_ids, r.num_faces, r.num_faces, &mesh->bvh)) {
+            *error = "bad mesh BVH";
+            return false;
+        }
+        meshes.push_back(mesh);
+    }
+
+    const SphereRecord *spheres = (const SphereRecord *)section(SPHERES, sizeof(SphereRecord));
+    const EllipsoidRecord *ellipsoids = (const EllipsoidRecord *)section(ELLIPSOIDS, sizeof(EllipsoidRecord));
+    const TriangleRecord *triangles = (const TriangleRecord *)section(TRIANGLES, sizeof(TriangleRecord));
+    const InstanceRecord *instances = (const InstanceRecord *)section(INSTANCES, sizeof(InstanceRecord));
+    const ObjectRef *refs = (const ObjectRef *)section(OBJECTS, sizeof(ObjectRef));
+    const uint64_t limits[4] = {count(SPHERES), count(ELLIPSOIDS), count(TRIANGLES), count(INSTANCES)};
+    objects->reserve(objects->size() + count(OBJECTS));
+    auto mtrl_of = [&](ObjectRef ref) -> uint64_t {
+        if (ref.type == SPHERE)
+            return spheres[ref.index].mtrl;
+        if (ref.type == ELLIPSOID)
+            return ellipsoids[ref.index].mtrl;
+        if (ref.type == TRIANGLE)
+            return triangles[ref.index].mtrl;
+        return instances[ref.index].mtrl;
+    };
+    for (uint64_t i = 0; in_bounds && i < count(OBJECTS); i++) {
+        ObjectRef ref = refs[i];
+        if (ref.type < SPHERE || ref.type > INSTANCE || ref.index < 0 || (uint64_t)ref.index >= limits[ref.type]) {
+            *error = "bad object reference";
+            return false;
+        }
+        if (mtrl_of(ref) >= count(MATERIALS)) {
+            *error = "bad material reference";
+            return false;
+        }
+        if (ref.type == SPHERE) {
+            const SphereRecord &r = spheres[ref.index];
+            objects->push_back(new Sphere(r.center[0], r.center[1], r.center[2], r.radius, r.mtrl));
+        } else if (ref.type == ELLIPSOID) {
+            const EllipsoidRecord &r = ellipsoids[ref.index];
+            Ellipsoid *e = new Ellipsoid();
+            e->mtrl_id = r.mtrl;
+            e->center = get(r.center);
+            e->radius = r.radius;
+            e->to_world = get_matrix(r.to_world);
+            e->to_object = get_matrix(r.to_object);
+            e->normal_mat = get_matrix(r.normal_mat);
+            e->world_bounds = AABB(get(r.lo), get(r.hi));
+            objects->push_back(e);
+        } else if (ref.type == TRIANGLE) {
+            const TriangleRecord &r = triangles[ref.index];
+            Triangle *t = new Triangle();
+            t->mtrl_id = r.mtrl;
+            t->a = get(r.a);
+            t->e1 = get(r.e1);
+            t->e2 = get(r.e2);
+            t->normal = get(r.normal);
+            objects->push_back(t);
+        } else {
+            const InstanceRecord &r = instances[ref.index];
+            if (r.mesh < 0 || r.mesh >= (int32_t)meshes.size()) {
+                *error = "bad mesh reference";
+                return false;
+            }
+            objects->push_back(new MeshInstance(meshes[r.mesh], r.mtrl, get_matrix(r.to_world),
+                                                get_matrix(r.to_object), get_matrix(r.normal_mat),
+                                                AABB(get(r.lo), get(r.hi))));
+        }
+    }
+
+    const NodeRecord *nodes = (const NodeRecord *)section(WORLD_NODES, sizeof(NodeRecord));
+    const int *prim_ids = (const int *)section(WORLD_PRIMS, sizeof(int));
+    if (!in_bounds) {
+        *error = "truncated file";
+        return false;
+    }
+    if (!get_nodes(nodes, count(WORLD_NODES), prim_ids, count(WORLD_PRIMS), count(OBJECTS), bvh)) {
+        *error = "bad world BVH";
+        return false;
+    }
+    return true;
+}
+
+}  // namespace SceneCache
+
+#endif
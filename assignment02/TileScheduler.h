@@ -0,0 +1,146 @@
+#ifndef __TILE_SCHEDULER_H
+#define __TILE_SCHEDULER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Splits an image into square tiles and renders them on a pool of threads.
+ *
+ * Tiles are ordered along a Morton (Z-order) curve and dealt out to the
+ * workers in contiguous runs, so each worker sweeps a compact region of the
+ * image. A worker takes tiles from the front of its own queue; once that is
+ * empty it steals from the back of another worker's queue, i.e. the tile
+ * farthest from where that worker currently is.
+ */
+class TileScheduler {
+ public:
+    struct Tile {
+        int x0, y0, x1, y1; // half-open pixel range [x0, x1) x [y0, y1)
+    };
+
+    static uint32_t morton_code(uint32_t x, uint32_t y) {
+        return spread_bits(x) | (spread_bits(y) << 1);
+    }
+
+    static vector<Tile> morton_tiles(int width, int height, int tile_size) {
+        int tiles_x = (width + tile_size - 1) / tile_size;
+        int tiles_y = (height + tile_size - 1) / tile_size;
+        vector<pair<uint32_t, Tile>> keyed;
+        keyed.reserve(tiles_x * tiles_y);
+        for (int ty = 0; ty < tiles_y; ty++) {
+            for (int tx = 0; tx < tiles_x; tx++) {
+                Tile tile;
+                tile.x0 = tx * tile_size;
+                tile.y0 = ty * tile_size;
+                tile.x1 = min(width, tile.x0 + tile_size);
+                tile.y1 = min(height, tile.y0 + tile_size);
+                keyed.push_back(make_pair(morton_code(tx, ty), tile));
+            }
+        }
+        sort(keyed.begin(), keyed.end(),
+             [](const pair<uint32_t, Tile> &a, const pair<uint32_t, Tile> &b) {
+                 return a.first < b.first;
+             });
+        vector<Tile> tiles;
+        tiles.reserve(keyed.size());
+        for (auto &it : keyed)
+            tiles.push_back(it.second);
+        return tiles;
+    }
+
+    static int default_threads() {
+        int n = thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+
+    // Calls render_tile(tile, worker_id) exactly once for every tile.
+    template <class F>
+    static void run(const vector<Tile> &tiles, int num_threads, F render_tile) {
+        num_threads = max(1, min(num_threads, (int)tiles.size()));
+        if (num_threads == 1) {
+            for (auto &tile : tiles)
+                render_tile(tile, 0);
+            return;
+        }
+
+        vector<WorkQueue> queues(num_threads);
+        for (int w = 0; w < num_threads; w++) {
+            int first = (long long)tiles.size() * w / num_threads;
+            int last = (long long)tiles.size() * (w + 1) / num_threads;
+            for (int i = first; i < last; i++)
+                queues[w].tasks.push_back(i);
+        }
+
+        auto worker = [&](int id) {
+            int task;
+            while (true) {
+                if (!queues[id].pop_front(&task)) {
+                    bool stolen = false;
+                    for (int k = 1; k < num_threads && !stolen; k++)
+                        stolen = queues[(id + k) % num_threads].pop_back(&task);
+                    // No tiles are ever added, so empty queues everywhere
+                    // means the image is done.
+                    if (!stolen)
+                        return;
+                }
+                render_tile(tiles[task], id);
+            }
+        };
+        vector<thread> threads;
+        for (int w = 1; w < num_threads; w++)
+            threads.emplace_back(worker, w);
+        worker(0);
+        for (auto &it : threads)
+            it.join();
+    }
+
+    // Calls body(begin, end) over [0, n) in runs of at most `grain`,
+    // scheduled like tiles of a one-pixel-high image.
+    template <class F>
+    static void parallel_for(int n, int grain, int num_threads, F body) {
+        vector<Tile> runs;
+        for (int i = 0; i < n; i += grain)
+            runs.push_back(Tile{i, 0, min(n, i + grain), 1});
+        run(runs, num_threads, [&](const Tile &r, int) { body(r.x0, r.x1); });
+    }
+
+ private:
+    struct WorkQueue {
+        mutex lock;
+        deque<int> tasks;
+        bool pop_front(int *task) {
+            lock_guard<mutex> guard(lock);
+            if (tasks.empty())
+                return false;
+            *task = tasks.front();
+            tasks.pop_front();
+            return true;
+        }
+        bool pop_back(int *task) {
+            lock_guard<mutex> guard(lock);
+            if (tasks.empty())
+                return false;
+            *task = tasks.back();
+            tasks.pop_back();
+            return true;
+        }
+    };
+
+    static uint32_t spread_bits(uint32_t v) {
+        v &= 0x0000ffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    }
+};
+
+#endif
@@ -5,93 +5,52 @@
 
 class Transformation {
  public:
-    Transformation() {
-        reset();
-    }
-    Transformation(Matrix mat_) {
-        mat = mat_;
-    }
-    Transformation(Matrix mat_, Matrix dir_mat_, Matrix norm_mat_) {
-        mat = mat_;
-        dir_mat = dir_mat_;
-        norm_mat = norm_mat_;
-    }
+    Transformation() = default;
+    Transformation(const Matrix &mat_) : mat(mat_) {}
+    Transformation(const Matrix &mat_, const Matrix &dir_mat_, const Matrix &norm_mat_) :
+        mat(mat_), dir_mat(dir_mat_), norm_mat(norm_mat_) {}
     ~Transformation() = default;
-    Vector apply(Vector vec) {
-        Vector ret = Vector(
-            mat[0][0] * vec.x + mat[0][1] * vec.y + mat[0][2] * vec.z + mat[0][3],
-            mat[1][0] * vec.x + mat[1][1] * vec.y + mat[1][2] * vec.z + mat[1][3],
-            mat[2][0] * vec.x + mat[2][1] * vec.y + mat[2][2] * vec.z + mat[2][3]
-        );
-        return ret;
+    Vector apply(const Vector &vec) const {
+        return mat.apply(vec);
     }
-    Vector apply_dir(Vector vec) {
-        Vector ret = Vector(
-            dir_mat[0][0] * vec.x + dir_mat[0][1] * vec.y + dir_mat[0][2] * vec.z + dir_mat[0][3],
-            dir_mat[1][0] * vec.x + dir_mat[1][1] * vec.y + dir_mat[1][2] * vec.z + dir_mat[1][3],
-            dir_mat[2][0] * vec.x + dir_mat[2][1] * vec.y + dir_mat[2][2] * vec.z + dir_mat[2][3]
-        );
-        return ret;
+    Vector apply_dir(const Vector &vec) const {
+        return dir_mat.apply_dir(vec);
     }
-    Vector apply_norm(Vector vec) {
-        Vector ret = Vector(
-            norm_mat[0][0] * vec.x + norm_mat[0][1] * vec.y + norm_mat[0][2] * vec.z + norm_mat[0][3],
-            norm_mat[1][0] * vec.x + norm_mat[1][1] * vec.y + norm_mat[1][2] * vec.z + norm_mat[1][3],
-            norm_mat[2][0] * vec.x + norm_mat[2][1] * vec.y + norm_mat[2][2] * vec.z + norm_mat[2][3]
-        );
-        return ret;
+    // norm_mat accumulates rotations and inverse scalings, so this is the
+    // inverse transpose of mat applied to a normal.
+    Vector apply_norm(const Vector &vec) const {
+        return norm_mat.apply_dir(vec);
     }
     void chain(const Transformation &other, int type) {
-        mat = mat.multiply(other.mat);
+        mat = mat * other.mat;
         // 0 = translation, 1 = rotation, 2 = scaling
-        if (type != 0) dir_mat = dir_mat.multiply(other.mat);
-        if (type == 1) norm_mat = norm_mat.multiply(other.mat);
-        else if (type == 2) norm_mat = norm_mat.multiply(other.mat.inverse());
+        if (type != 0) dir_mat = dir_mat * other.mat;
+        if (type == 1) norm_mat = norm_mat * other.mat;
+        else if (type == 2) norm_mat = norm_mat * other.mat.inverse();
     }
     void pre_chain(const Transformation &other, int type) {
-        mat = other.mat.multiply(mat);
+        mat = other.mat * mat;
         // 0 = translation, 1 = rotation, 2 = scaling
-        if (type != 0) dir_mat = other.mat.multiply(dir_mat);
-        if (type == 1) norm_mat = other.mat.multiply(norm_mat);
-        else if (type == 2) norm_mat = other.mat.inverse().multiply(norm_mat);
+        if (type != 0) dir_mat = other.mat * dir_mat;
+        if (type == 1) norm_mat = other.mat * norm_mat;
+        else if (type == 2) norm_mat = other.mat.inverse() * norm_mat;
     }
     void reset() {
-        mat = Matrix::identity(4);
-        dir_mat = Matrix::identity(4);
-        norm_mat = Matrix::identity(4);
+        mat = Matrix::identity();
+        dir_mat = Matrix::identity();
+        norm_mat = Matrix::identity();
     }
-    Transformation inverse() {
+    Transformation inverse() const {
         return Transformation(mat.inverse(), dir_mat.inverse(), norm_mat.inverse());
     }
-    Transformation transpose() {
-        return Transformation(mat.transpose(), dir_mat.transpose(), norm_mat.inverse());
-    }
     void print_dir_mat() {
-        for (int i = 0; i < dir_mat.sz; i++) {
-            for (int j = 0; j < dir_mat.sz; j++) {
-                cout << dir_mat[i][j] << " ";
-            }
-            cout << endl;
-        }
-        cout << endl;
+        cout << dir_mat << endl;
     }
     void print_norm_mat() {
-        for (int i = 0; i < norm_mat.sz; i++) {
-            for (int j = 0; j < norm_mat.sz; j++) {
-                cout << norm_mat[i][j] << " ";
-            }
-            cout << endl;
-        }
-        cout << endl;
+        cout << norm_mat << endl;
     }
     friend ostream& operator<< (ostream &out, Transformation &trans) {
-        for (int i = 0; i < trans.mat.sz; i++) {
-            for (int j = 0; j < trans.mat.sz; j++) {
-                out << trans.mat[i][j] << " ";
-            }
-            out << endl;
-        }
-        return out;
+        return out << trans.mat;
     }
     Matrix mat;
     Matrix dir_mat;
@@ -128,7 +87,6 @@ class Translation : public Transformation {
  public:
     Translation() : Transformation() {}
     Translation(double tx_, double ty_, double tz_) {
-        Transformation();
         mat.vals[0][3] = tx_;
         mat.vals[1][3] = ty_;
         mat.vals[2][3] = tz_;
@@ -140,7 +98,6 @@ class Scaling : public Transformation {
  public:
     Scaling() : Transformation() {}
     Scaling(double sx_, double sy_, double sz_) {
-        Transformation();
         mat.vals[0][0] = sx_;
         mat.vals[1][1] = sy_;
         mat.vals[2][2] = sz_;
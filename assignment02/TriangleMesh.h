@@ -0,0 +1,205 @@
+#ifndef __TRIANGLE_MESH_H
+#define __TRIANGLE_MESH_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "BVH.h"
+#include "GeoObject.h"
+#include "Matrix.h"
+#include "Packet.h"
+#include "RenderStats.h"
+#include "Transformation.h"
+
+/**
+ * Indexed triangle mesh sharing one material.
+ *
+ * Vertex positions are stored once, as separate x/y/z arrays, and each face
+ * is three 32-bit indices plus its precomputed unit normal. The mesh keeps
+ * its own BVH over the faces, and finalize() reorders the faces into BVH
+ * leaf order so a leaf's faces sit next to each other in memory.
+ */
+class TriangleMesh : public GeoObject {
+ public:
+    struct Face {
+        uint32_t v[3];
+        float normal[3];
+    };
+
+    TriangleMesh() = default;
+    TriangleMesh(MaterialId mtrl_) : GeoObject(mtrl_) {}
+    ~TriangleMesh() = default;
+
+    uint32_t add_vertex(double x, double y, double z) {
+        xs.push_back(x);
+        ys.push_back(y);
+        zs.push_back(z);
+        return xs.size() - 1;
+    }
+    void add_face(uint32_t a, uint32_t b, uint32_t c) {
+        Face face;
+        face.v[0] = a;
+        face.v[1] = b;
+        face.v[2] = c;
+        faces.push_back(face);
+    }
+    int num_vertices() const {
+        return xs.size();
+    }
+    int num_faces() const {
+        return faces.size();
+    }
+    Vector vertex(uint32_t i) const {
+        return Vector(xs[i], ys[i], zs[i]);
+    }
+    // Computes the face normals and builds the BVH. Call once all faces
+    // have been added.
+    void finalize() {
+        vector<AABB> face_bounds(faces.size());
+        for (int f = 0; f < (int)faces.size(); f++) {
+            Vector a = vertex(faces[f].v[0]), b = vertex(faces[f].v[1]), c = vertex(faces[f].v[2]);
+            Vector n = (b - a).cross(c - a).normalized();
+            faces[f].normal[0] = n.x;
+            faces[f].normal[1] = n.y;
+            faces[f].normal[2] = n.z;
+            AABB box;
+            box.expand(a);
+            box.expand(b);
+            box.expand(c);
+            face_bounds[f] = box.padded(EPS);
+        }
+        bvh.build(face_bounds);
+
+        vector<Face> ordered(faces.size());
+        for (int i = 0; i < (int)faces.size(); i++) {
+            ordered[i] = faces[bvh.prim_ids[i]];
+            bvh.prim_ids[i] = i;
+        }
+        faces.swap(ordered);
+    }
+    bool intersect(const Vector &ray_pos, const Vector &ray_dir, double *t, Vector *normal) {
+        int hit_face = -1, tests = 0, hits = 0;
+        bvh.traverse(ray_pos, ray_dir, t, [&](int f) {
+            tests++;
+            if (face_hit(f, ray_pos, ray_dir, t)) {
+                hit_face = f;
+                hits++;
+            }
+            return false;
+        });
+        RenderStats::add(RenderStats::MESH_FACE_TESTS, tests);
+        RenderStats::add(RenderStats::MESH_FACE_HITS, hits);
+        if (hit_face < 0)
+            return false;
+        if (normal) {
+            const float *n = faces[hit_face].normal;
+            normal->set(n[0], n[1], n[2]);
+        }
+        return true;
+    }
+    bool occluded(const Vector &ray_pos, const Vector &ray_dir, double t_max) {
+        int tests = 0;
+        bool hit = bvh.occluded(ray_pos, ray_dir, t_max, [&](int f) {
+            double t = t_max;
+            tests++;
+            return face_hit(f, ray_pos, ray_dir, &t);
+        });
+        RenderStats::add(RenderStats::MESH_FACE_TESTS, tests);
+        RenderStats::add(RenderStats::MESH_FACE_HITS, hit);
+        return hit;
+    }
+    AABB bounds() {
+        return bvh.bounds();
+    }
+    void intersect_packet(RayPacket &packet) {
+        const PacketKernels &kernels = packet_kernels();
+        traverse_packet(bvh, packet, [&](int f) {
+            const uint32_t *v = faces[f].v;
+            float v0[3] = {(float)xs[v[0]], (float)ys[v[0]], (float)zs[v[0]]};
+            float e1[3] = {(float)(xs[v[1]] - xs[v[0]]), (float)(ys[v[1]] - ys[v[0]]), (float)(zs[v[1]] - zs[v[0]])};
+            float e2[3] = {(float)(xs[v[2]] - xs[v[0]]), (float)(ys[v[2]] - ys[v[0]]), (float)(zs[v[2]] - zs[v[0]])};
+            kernels.triangle(packet, v0, e1, e2, this);
+        });
+    }
+    // Bytes held by the mesh: vertices, faces and BVH.
+    size_t memory_bytes() const {
+        return xs.capacity() * 3 * sizeof(double) + faces.capacity() * sizeof(Face) +
+               bvh.nodes.capacity() * sizeof(BVH::Node) + bvh.prim_ids.capacity() * sizeof(int);
+    }
+    vector<double> xs, ys, zs;
+    vector<Face> faces;
+    BVH bvh;
+
+ private:
+    // Hit on face f closer than *t; updates *t.
+    bool face_hit(int f, const Vector &ray_pos, const Vector &ray_dir, double *t) {
+        const uint32_t *v = faces[f].v;
+        Vector a = vertex(v[0]);
+        return Triangle::hit(a, vertex(v[1]) - a, vertex(v[2]) - a, ray_pos, ray_dir, t);
+    }
+};
+
+/**
+ * One placement of a shared mesh, a TriangleMesh or a ChunkedMesh: the
+ * mesh and its BVH stay in the mesh's own (object) space and are loaded
+ * once, however many instances refer to them. Each instance has its own transformation and material.
+ * Rays are taken to object space the way Ellipsoid does it; the map is
+ * affine and the direction is not renormalized, so t is the same in both
+ * spaces.
+ */
+class MeshInstance : public GeoObject {
+ public:
+    MeshInstance(shared_ptr<GeoObject> mesh_, MaterialId mtrl_, const Transformation &trans) :
+        GeoObject(mtrl_), mesh(mesh_), to_world(trans.mat), to_object(trans.mat.inverse()),
+        normal_mat(trans.norm_mat) {
+        AABB local = mesh->bounds();
+        for (int i = 0; i < 8; i++) {
+            Vector corner((i & 1) ? local.hi.x : local.lo.x, (i & 2) ? local.hi.y : local.lo.y,
+                          (i & 4) ? local.hi.z : local.lo.z);
+            world_bounds.expand(to_world.apply(corner));
+        }
+        world_bounds = world_bounds.padded(EPS);
+    }
+    // Placement already worked out, as stored in a compiled scene.
+    MeshInstance(shared_ptr<GeoObject> mesh_, MaterialId mtrl_, const Matrix &to_world_,
+                 const Matrix &to_object_, const Matrix &normal_mat_, const AABB &world_bounds_) :
+        GeoObject(mtrl_), mesh(mesh_), to_world(to_world_), to_object(to_object_),
+        normal_mat(normal_mat_), world_bounds(world_bounds_) {}
+    ~MeshInstance() = default;
+    bool intersect(const Vector &ray_pos, const Vector &ray_dir, double *t, Vector *normal) {
+        Vector local_normal;
+        if (!mesh->intersect(to_object.apply(ray_pos), to_object.apply_dir(ray_dir), t,
+                             normal ? &local_normal : nullptr))
+            return false;
+        if (normal)
+            *normal = normal_mat.apply_dir(local_normal).normalized();
+        return true;
+    }
+    bool occluded(const Vector &ray_pos, const Vector &ray_dir, double t_max) {
+        return mesh->occluded(to_object.apply(ray_pos), to_object.apply_dir(ray_dir), t_max);
+    }
+    AABB bounds() {
+        return world_bounds;
+    }
+    void intersect_packet(RayPacket &packet) {
+        RayPacket local = packet.transformed(to_object);
+        if (packet.has_frustum)
+            local.build_frustum(to_object.apply(packet.apex));
+        mesh->intersect_packet(local);
+        packet.uncertain |= local.uncertain;
+        for (int k = 0; k < PACKET_SIZE; k++) {
+            if (local.hit[k] == mesh.get()) {
+                packet.t[k] = local.t[k];
+                packet.hit[k] = this;
+            }
+        }
+    }
+    shared_ptr<GeoObject> mesh;
+    // object space -> world space, its inverse, and the inverse transpose
+    // for normals
+    Matrix to_world, to_object, normal_mat;
+    AABB world_bounds;
+};
+
+#endif
@@ -4,6 +4,11 @@
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include <cstring>
+
+#if defined(RT_SIMD_VECTOR) && (defined(__SSE2__) || defined(__AVX__))
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -13,119 +18,318 @@ const double PI = acos(-1.0);
 
 inline double sqr(double x) { return x * x; }
 
-class Vector {
+/**
+ * SIMD backend of Vec3<T>: one register holding the x, y, z and padding
+ * lanes of a vector. Built with -DRT_SIMD_VECTOR, float vectors use SSE
+ * and, with -mavx, double vectors use AVX; otherwise Vec3 is plain scalar
+ * code. The backends are off by default because they lose here: nearly
+ * every use of a vector reads single components, so values keep moving
+ * between vector and scalar registers, and a 3-wide dot or cross saves
+ * too little to pay for that (see `benchmark precision`).
+ *
+ * Every lane is computed with the same operations, in the same order, as
+ * the scalar code, so results are bit-identical to it: dot() sums
+ * (x + y) + z, and clip() uses min(1, v) then max(0, v), which match
+ * std::min and std::max for NaN too.
+ */
+template <class T>
+struct VectorLanes {
+    static const bool enabled = false;
+};
+
+#if defined(RT_SIMD_VECTOR) && defined(__SSE2__)
+template <>
+struct VectorLanes<float> {
+    static const bool enabled = true;
+    typedef __m128 reg;
+    static reg set(float x, float y, float z) { return _mm_set_ps(0.0f, z, y, x); }
+    static reg splat(float k) { return _mm_set1_ps(k); }
+    static reg add(reg a, reg b) { return _mm_add_ps(a, b); }
+    static reg sub(reg a, reg b) { return _mm_sub_ps(a, b); }
+    static reg mul(reg a, reg b) { return _mm_mul_ps(a, b); }
+    static reg div(reg a, reg b) { return _mm_div_ps(a, b); }
+    static reg neg(reg a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+    static reg clip(reg a) {
+        return _mm_max_ps(_mm_setzero_ps(), _mm_min_ps(_mm_set1_ps(1.0f), a));
+    }
+    // (y, z, x, w)
+    static reg yzx(reg a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)); }
+    static float dot(reg a, reg b) {
+        reg p = _mm_mul_ps(a, b);
+        reg s = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+        return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2))));
+    }
+};
+#endif
+
+#if defined(RT_SIMD_VECTOR) && defined(__AVX__)
+template <>
+struct VectorLanes<double> {
+    static const bool enabled = true;
+    typedef __m256d reg;
+    static reg set(double x, double y, double z) { return _mm256_set_pd(0.0, z, y, x); }
+    static reg splat(double k) { return _mm256_set1_pd(k); }
+    static reg add(reg a, reg b) { return _mm256_add_pd(a, b); }
+    static reg sub(reg a, reg b) { return _mm256_sub_pd(a, b); }
+    static reg mul(reg a, reg b) { return _mm256_mul_pd(a, b); }
+    static reg div(reg a, reg b) { return _mm256_div_pd(a, b); }
+    static reg neg(reg a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+    static reg clip(reg a) {
+        return _mm256_max_pd(_mm256_setzero_pd(), _mm256_min_pd(_mm256_set1_pd(1.0), a));
+    }
+    // (y, z, x, w); AVX has no cross-lane permute of doubles, so pick from
+    // (x, y, x, y) and (z, w, z, w).
+    static reg yzx(reg a) {
+        return _mm256_shuffle_pd(_mm256_permute2f128_pd(a, a, 0x00),
+                                 _mm256_permute2f128_pd(a, a, 0x11), 0x9);
+    }
+    static double dot(reg a, reg b) {
+        reg p = _mm256_mul_pd(a, b);
+        __m128d xy = _mm256_castpd256_pd128(p);
+        __m128d s = _mm_add_sd(xy, _mm_unpackhi_pd(xy, xy));
+        return _mm_cvtsd_f64(_mm_add_sd(s, _mm256_extractf128_pd(p, 1)));
+    }
+};
+#endif
+
+// Components of a Vec3. With a SIMD backend for T a padding lane w rounds
+// the size up to a full register and the storage is aligned to it;
+// without one the vector stays three packed scalars.
+template <class T, bool padded>
+struct VectorStorage {
+    T x, y, z;
+};
+
+template <class T>
+struct alignas(4 * sizeof(T)) VectorStorage<T, true> {
+    T x, y, z;
+    T w; // padding lane
+};
+
+/**
+ * Three-component vector of float or double.
+ *
+ * When VectorLanes<T> has a backend (float with SSE2, double with AVX) a
+ * vector is one 16- or 32-byte aligned register's worth, loaded and
+ * stored with a single aligned access. w is zero on construction;
+ * operations carry it along but it never affects x, y or z. There is no
+ * user-written copy constructor, so Vec3 is trivially copyable.
+ */
+template <class T>
+class Vec3 : public VectorStorage<T, VectorLanes<T>::enabled> {
+    typedef VectorLanes<T> Lanes;
+    typedef VectorStorage<T, Lanes::enabled> Storage;
+
  public:
- 	Vector() : x(0.0), y(0.0), z(0.0) {}
- 	Vector(double x_, double y_, double z_) : x(x_), y(y_), z(z_) {}
- 	Vector(const Vector &other) {
- 		x = other.x;
- 		y = other.y;
- 		z = other.z;
- 	}
- 	~Vector() = default;
- 	friend Vector operator+ (Vector v, const Vector &other) {
- 		v.x += other.x;
- 		v.y += other.y;
- 		v.z += other.z;
- 		return v;
- 	}
- 	friend Vector operator- (Vector v, const Vector &other) {
- 		v.x -= other.x;
- 		v.y -= other.y;
- 		v.z -= other.z;
- 		return v;
- 	}
- 	friend Vector operator+ (Vector v, double k) {
- 		v.x += k;
- 		v.y += k;
- 		v.z += k;
- 		return v;
- 	}
- 	friend Vector operator- (Vector v, double k) {
- 		v.x -= k;
- 		v.y -= k;
- 		v.z -= k;
- 		return v;
- 	}
- 	friend Vector operator* (double k, Vector v) {
- 		v.x *= k;
- 		v.y *= k;
- 		v.z *= k;
- 		return v;
- 	}
- 	friend Vector operator* (Vector v, double k) {
- 		v.x *= k;
- 		v.y *= k;
- 		v.z *= k;
- 		return v;
- 	}
- 	friend Vector operator/ (Vector v, double k) {
- 		v.x /= k;
- 		v.y /= k;
- 		v.z /= k;
- 		return v;
- 	}
-    friend Vector operator* (Vector v, const Vector &other) {
-        v.x *= other.x;
-        v.y *= other.y;
-        v.z *= other.z;
+    using Storage::x;
+    using Storage::y;
+    using Storage::z;
+
+    Vec3() : Vec3(0, 0, 0) {}
+    Vec3(T x_, T y_, T z_) {
+        // One full-width store, so the next vector load of it is forwarded
+        // from the store buffer instead of stalling on three partial ones.
+        if constexpr (Lanes::enabled)
+            assign(Lanes::set(x_, y_, z_));
+        else
+            set(x_, y_, z_);
+    }
+    friend Vec3 operator+ (const Vec3 &a, const Vec3 &other) {
+        Vec3 v = a;
+        if constexpr (Lanes::enabled) {
+            v.assign(Lanes::add(v.lanes(), other.lanes()));
+        } else {
+            v.x += other.x;
+            v.y += other.y;
+            v.z += other.z;
+        }
         return v;
     }
-    friend Vector operator/ (Vector v, const Vector &other) {
-        v.x /= other.x;
-        v.y /= other.y;
-        v.z /= other.z;
+    friend Vec3 operator- (const Vec3 &a, const Vec3 &other) {
+        Vec3 v = a;
+        if constexpr (Lanes::enabled) {
+            v.assign(Lanes::sub(v.lanes(), other.lanes()));
+        } else {
+            v.x -= other.x;
+            v.y -= other.y;
+            v.z -= other.z;
+        }
         return v;
     }
- 	void set(double x_, double y_, double z_) {
- 		x = x_;
- 		y = y_;
- 		z = z_;
- 	}
-    Vector normalized() const {
-        Vector vec(x, y, z);
-        vec.normalize();
-        return vec;
+    friend Vec3 operator+ (const Vec3 &a, T k) {
+        Vec3 v = a;
+        if constexpr (Lanes::enabled) {
+            v.assign(Lanes::add(v.lanes(), Lanes::splat(k)));
+        } else {
+            v.x += k;
+            v.y += k;
+            v.z += k;
+        }
+        return v;
     }
- 	void normalize() {
- 		double d = sqrt(x * x + y * y + z * z);
-	 	if (d > EPS) {
-	 		x /= d;
-	 		y /= d;
-	 		z /= d;
-	 	}
- 	}
-    Vector cross(const Vector &other) {
-        return Vector (y * other.z - z * other.y, z * other.x - x * other.z, x * other.y - y * other.x);
-    }
- 	double dot(const Vector &other) const {
- 		return x * other.x + y * other.y + z * other.z;
- 	}
-    Vector clip() {
-        Vector v(x, y, z);
-        v.x = max(min(v.x, 1.0), 0.0);
-        v.y = max(min(v.y, 1.0), 0.0);
-        v.z = max(min(v.z, 1.0), 0.0);
+    friend Vec3 operator- (const Vec3 &a, T k) {
+        Vec3 v = a;
+        if constexpr (Lanes::enabled) {
+            v.assign(Lanes::sub(v.lanes(), Lanes::splat(k)));
+        } else {
+            v.x -= k;
+            v.y -= k;
+            v.z -= k;
+        }
         return v;
     }
-    friend Vector operator- (Vector v) {
-        v.x = -v.x;
-        v.y = -v.y;
-        v.z = -v.z;
+    friend Vec3 operator* (T k, const Vec3 &v) {
+        return v * k;
+    }
+    friend Vec3 operator* (const Vec3 &a, T k) {
+        Vec3 v = a;
+        if constexpr (Lanes::enabled) {
+            v.assign(Lanes::mul(v.lanes(), Lanes::splat(k)));
+        } else {
+            v.x *= k;
+            v.y *= k;
+            v.z *= k;
+        }
         return v;
     }
- 	friend istream& operator>> (istream &in, Vector &v) {
- 		in >> v.x >> v.y >> v.z;
- 		return in;
- 	}
- 	friend ostream& operator<< (ostream &out, const Vector &v) {
- 		out << v.x << ", " << v.y << ", " << v.z;
- 		return out;
- 	}
-    double norm() const {
-        return sqrt(sqr(x) + sqr(y) + sqr(z));
-    }
- 	double x, y, z;
+    friend Vec3 operator/ (const Vec3 &a, T k) {
+        Vec3 v = a;
+        if constexpr (Lanes::enabled) {
+            v.assign(Lanes::div(v.lanes(), Lanes::splat(k)));
+        } else {
+            v.x /= k;
+            v.y /= k;
+            v.z /= k;
+        }
+        return v;
+    }
+    friend Vec3 operator* (const Vec3 &a, const Vec3 &other) {
+        Vec3 v = a;
+        if constexpr (Lanes::enabled) {
+            v.assign(Lanes::mul(v.lanes(), other.lanes()));
+        } else {
+            v.x *= other.x;
+            v.y *= other.y;
+            v.z *= other.z;
+        }
+        return v;
+    }
+    friend Vec3 operator/ (const Vec3 &a, const Vec3 &other) {
+        Vec3 v = a;
+        if constexpr (Lanes::enabled) {
+            v.assign(Lanes::div(v.lanes(), other.lanes()));
+        } else {
+            v.x /= other.x;
+            v.y /= other.y;
+            v.z /= other.z;
+        }
+        return v;
+    }
+    friend Vec3 operator- (const Vec3 &a) {
+        Vec3 v = a;
+        if constexpr (Lanes::enabled) {
+            v.assign(Lanes::neg(v.lanes()));
+        } else {
+            v.x = -v.x;
+            v.y = -v.y;
+            v.z = -v.z;
+        }
+        return v;
+    }
+    void set(T x_, T y_, T z_) {
+        x = x_;
+        y = y_;
+        z = z_;
+    }
+    Vec3 normalized() const {
+        Vec3 vec = *this;
+        vec.normalize();
+        return vec;
+    }
+    void normalize() {
+        T d = sqrt(dot(*this));
+        if (d > EPS)
+            *this = *this / d;
+    }
+    Vec3 cross(const Vec3 &other) const {
+        if constexpr (Lanes::enabled) {
+            // (a * b.yzx - a.yzx * b).yzx, one shuffle fewer than the
+            // textbook a.yzx * b.zxy - a.zxy * b.yzx and the same products.
+            typename Lanes::reg a = lanes(), b = other.lanes();
+            Vec3 v;
+            v.assign(Lanes::yzx(Lanes::sub(Lanes::mul(a, Lanes::yzx(b)),
+                                           Lanes::mul(Lanes::yzx(a), b))));
+            return v;
+        } else {
+            return Vec3(y * other.z - z * other.y, z * other.x - x * other.z, x * other.y - y * other.x);
+        }
+    }
+    T dot(const Vec3 &other) const {
+        if constexpr (Lanes::enabled)
+            return Lanes::dot(lanes(), other.lanes());
+        else
+            return x * other.x + y * other.y + z * other.z;
+    }
+    // Each component clamped to [0, 1].
+    Vec3 clip() const {
+        if constexpr (Lanes::enabled) {
+            Vec3 v;
+            v.assign(Lanes::clip(lanes()));
+            return v;
+        } else {
+            return Vec3(max(min(x, T(1)), T(0)), max(min(y, T(1)), T(0)), max(min(z, T(1)), T(0)));
+        }
+    }
+    friend istream& operator>> (istream &in, Vec3 &v) {
+        in >> v.x >> v.y >> v.z;
+        return in;
+    }
+    friend ostream& operator<< (ostream &out, const Vec3 &v) {
+        out << v.x << ", " << v.y << ", " << v.z;
+        return out;
+    }
+    T norm() const {
+        return sqrt(dot(*this));
+    }
+
+ private:
+    // Whole-object copies: going through &x would reach y, z and w
+    // through a pointer to x alone, which the optimizer may assume does
+    // not happen. Both compile to one aligned vector move.
+    template <class L = Lanes>
+    typename L::reg lanes() const {
+        static_assert(sizeof(typename L::reg) == sizeof(Storage), "one register per vector");
+        typename L::reg r;
+        memcpy(&r, static_cast<const Storage *>(this), sizeof(r));
+        return r;
+    }
+    template <class L = Lanes>
+    void assign(typename L::reg r) {
+        memcpy(static_cast<Storage *>(this), &r, sizeof(r));
+    }
 };
 
+/**
+ * The ray tracer's scalar type: double, or float when built with
+ * -DRT_FLOAT, which halves the size of every vector, box and primitive
+ * and runs the vector math of intersection and shading in single
+ * precision. Transformation matrices and ray distances stay double.
+ */
+#ifdef RT_FLOAT
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
+typedef Vec3<Real> Vector;
+
+// How far secondary rays start from the surface they leave. A float
+// position is only good to about 1e-7 of its magnitude, so EPS would let
+// rays hit the surface they start on.
+#ifdef RT_FLOAT
+const double RAY_EPS = 1e-3;
+#else
+const double RAY_EPS = EPS;
+#endif
+
 #endif
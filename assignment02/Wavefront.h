@@ -0,0 +1,98 @@
+#ifndef __WAVEFRONT_H
+#define __WAVEFRONT_H
+
+#include <vector>
+
+#include "Vector.h"
+
+class GeoObject;
+
+/**
+ * Ray queues for wavefront rendering.
+ *
+ * Instead of following one ray through all of its bounces, the renderer
+ * keeps every ray of a bounce in a RayQueue, structure-of-arrays, and runs
+ * each stage (closest hit, shadow rays, shading, reflection) over the
+ * whole queue before the next stage starts. Each ray remembers the path
+ * (pixel) it belongs to, the depth it has left and its throughput.
+ * Recursion depth becomes one queue per bounce, so a path's color is only
+ * known once all of its bounces are done: every bounce records, per ray
+ * that hit something, the light it gathered directly and the reflectance
+ * its reflection is weighted by, and the levels are folded together from
+ * the last bounce back to the first.
+ */
+struct RayQueue {
+    void clear() {
+        resize(0);
+    }
+    void resize(int n) {
+        ox.resize(n);
+        oy.resize(n);
+        oz.resize(n);
+        dx.resize(n);
+        dy.resize(n);
+        dz.resize(n);
+        path.resize(n);
+        depth.resize(n);
+        tx.resize(n);
+        ty.resize(n);
+        tz.resize(n);
+    }
+    int size() const {
+        return path.size();
+    }
+    void set(int i, const Vector &origin, const Vector &dir, int path_,
+             int depth_ = 0, const Vector &throughput = Vector()) {
+        ox[i] = origin.x;
+        oy[i] = origin.y;
+        oz[i] = origin.z;
+        dx[i] = dir.x;
+        dy[i] = dir.y;
+        dz[i] = dir.z;
+        path[i] = path_;
+        depth[i] = depth_;
+        tx[i] = throughput.x;
+        ty[i] = throughput.y;
+        tz[i] = throughput.z;
+    }
+    // Moves ray j to slot i.
+    void move(int i, int j) {
+        set(i, origin(j), dir(j), path[j], depth[j], throughput(j));
+    }
+    Vector origin(int i) const {
+        return Vector(ox[i], oy[i], oz[i]);
+    }
+    Vector dir(int i) const {
+        return Vector(dx[i], dy[i], dz[i]);
+    }
+    Vector throughput(int i) const {
+        return Vector(tx[i], ty[i], tz[i]);
+    }
+    vector<double> ox, oy, oz, dx, dy, dz;
+    vector<int> path;
+    vector<int> depth;          // bounces left, as trace()'s depth
+    vector<double> tx, ty, tz;  // weight of the ray's color in its pixel
+};
+
+// What one bounce of a wavefront found, for the rays that hit something.
+struct BounceLevel {
+    vector<int> path;
+    vector<Vector> direct;      // light gathered at the hit point
+    vector<Vector> reflectance; // weight of the light reflected there
+};
+
+struct Wavefront {
+    RayQueue rays;           // rays of the current bounce
+    // closest hit of each ray in `rays`
+    vector<GeoObject *> hit;
+    vector<double> t, nx, ny, nz;
+    vector<int> live;        // indices into `rays` of the rays that hit
+    RayQueue shadow;         // one ray per live ray and non-ambient light
+    vector<double> shadow_t_max;
+    vector<char> blocked;
+    RayQueue next;           // reflected rays, for the next bounce
+    vector<char> reflected;  // whether each live ray spawned one
+    vector<BounceLevel> levels;
+};
+
+#endif
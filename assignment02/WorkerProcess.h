@@ -0,0 +1,150 @@
+#ifndef __WORKER_PROCESS_H
+#define __WORKER_PROCESS_H
+
+#include <cerrno>
+#include <csignal>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+/**
+ * A child process spoken to over its stdin and stdout.
+ *
+ * Workers are started either directly (argv) or through /bin/sh -c, which
+ * lets the command reach another host, e.g. "ssh render2 ./raytracer ...".
+ * The child's stderr is left attached to ours so its messages show up.
+ * Reads and writes block until the whole buffer is transferred; they
+ * return false when the child has gone away.
+ */
+class WorkerProcess {
+ public:
+    WorkerProcess() : pid(-1), to_child(-1), from_child(-1) {}
+
+    bool start(const vector<string> &args) {
+        vector<char *> argv;
+        for (auto &it : args)
+            argv.push_back(const_cast<char *>(it.c_str()));
+        argv.push_back(nullptr);
+        return spawn(argv.data());
+    }
+
+    bool start_shell(const string &command) {
+        char *argv[] = {const_cast<char *>("/bin/sh"), const_cast<char *>("-c"),
+                        const_cast<char *>(command.c_str()), nullptr};
+        return spawn(argv);
+    }
+
+    bool running() const {
+        return pid > 0;
+    }
+
+    bool write_all(const void *data, size_t size) {
+        return write_fully(to_child, data, size);
+    }
+
+    bool read_all(void *data, size_t size) {
+        return read_fully(from_child, data, size);
+    }
+
+    static bool write_fully(int fd, const void *data, size_t size) {
+        const char *p = static_cast<const char *>(data);
+        while (size > 0) {
+            ssize_t n = write(fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static bool read_fully(int fd, void *data, size_t size) {
+        char *p = static_cast<char *>(data);
+        while (size > 0) {
+            ssize_t n = read(fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // Closes the child's stdin, which tells a well-behaved worker to exit,
+    // and reaps it. Returns true if it exited with status 0.
+    bool finish() {
+        if (pid <= 0)
+            return false;
+        close_pipes();
+        int status = 0;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        pid = -1;
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    void kill_now() {
+        if (pid > 0)
+            kill(pid, SIGKILL);
+        finish();
+    }
+
+    pid_t pid;
+    int to_child, from_child;
+
+ private:
+    bool spawn(char *const argv[]) {
+        int in[2], out[2];
+        if (pipe(in) != 0)
+            return false;
+        if (pipe(out) != 0) {
+            close(in[0]);
+            close(in[1]);
+            return false;
+        }
+        pid = fork();
+        if (pid == 0) {
+            dup2(in[0], STDIN_FILENO);
+            dup2(out[1], STDOUT_FILENO);
+            close(in[0]);
+            close(in[1]);
+            close(out[0]);
+            close(out[1]);
+            execv(argv[0], argv);
+            _exit(127);
+        }
+        close(in[0]);
+        close(out[1]);
+        to_child = in[1];
+        from_child = out[0];
+        // Other children must not inherit our ends, or a worker's stdin
+        // would stay open after we close it.
+        fcntl(to_child, F_SETFD, FD_CLOEXEC);
+        fcntl(from_child, F_SETFD, FD_CLOEXEC);
+        if (pid < 0) {
+            close_pipes();
+            return false;
+        }
+        return true;
+    }
+
+    void close_pipes() {
+        if (to_child >= 0)
+            close(to_child);
+        if (from_child >= 0)
+            close(from_child);
+        to_child = from_child = -1;
+    }
+};
+
+#endif
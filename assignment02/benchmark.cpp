@@ -0,0 +1,450 @@
+/**
+ * Benchmark - regression and performance runs of the CS 184 raytracer
+ *
+ * Commands:
+ * benchmark run [--raytracer ./raytracer] [--scenes test_files] [--out bench_out]
+ *               [--history bench_history.csv] [--label NAME]
+ *               [--min-psnr DB] [--max-error E] [-- raytracer options...]
+ *     Renders every .in scene in the scenes directory. A scene with a .png
+ *     of the same name is compared against it and fails when its PSNR is
+ *     below DB (default 30) or a channel differs by more than E (0..1,
+ *     default 1, i.e. off). Wall time, rays/s and peak RSS of each render
+ *     are appended to the CSV history. Exits with 1 if any scene failed.
+ *
+ * benchmark generate spheres|mesh N output.in
+ *     Writes a synthetic scene of N spheres, or of an N-triangle mesh
+ *     (plus output.obj).
+ *
+ * benchmark scaling spheres|mesh N1 N2 ... [run options]
+ *     Generates one scene per size into the output directory and renders
+ *     each, recording the results in the history for scaling curves.
+ *
+ * benchmark precision [--float-raytracer ./raytracer_float] [run options]
+ *     Renders every scene with both the double build (--raytracer) and the
+ *     float build, reports their throughput side by side, and compares the
+ *     float image against the double one with --min-psnr / --max-error.
+ *     Both runs are recorded in the history, labelled double and float.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "pngwriter/src/pngwriter.h"
+
+using namespace std;
+
+struct Options {
+	string raytracer = "./raytracer";
+	string float_raytracer = "./raytracer_float";
+	string scenes = "test_files";
+	string out = "bench_out";
+	string history = "bench_history.csv";
+	string label;
+	double min_psnr = 30.0;
+	double max_error = 1.0;
+	vector<string> raytracer_args;
+};
+
+struct RunResult {
+	bool ok = false;
+	double wall_seconds = 0.0;
+	double render_seconds = 0.0;
+	double rays = 0.0;
+	double rays_per_second = 0.0;
+	long peak_rss_kb = 0;
+	int width = 0, height = 0;
+};
+
+struct Comparison {
+	bool compared = false;
+	double psnr = 0.0;
+	double max_error = 0.0;
+};
+
+string absolute_path(const string &path) {
+	char buf[PATH_MAX];
+	return realpath(path.c_str(), buf) ? string(buf) : path;
+}
+
+// Value of the first "key": number pair in a flat JSON text, or 0.
+double json_number(const string &text, const string &key) {
+	size_t pos = text.find("\"" + key + "\":");
+	return pos == string::npos ? 0.0 : atof(text.c_str() + pos + key.size() + 3);
+}
+
+/**
+ * Renders one scene in a child process, from inside the scene's directory
+ * so relative .obj paths resolve. Wall time covers the whole process; peak
+ * RSS comes from the child's resource usage; ray counts and the render
+ * phase time come from the raytracer's --stats report.
+ */
+RunResult run_raytracer(const Options &opt, const string &scene_dir, const string &scene,
+                        const string &image, const string &stats) {
+	RunResult result;
+	vector<string> args = {opt.raytracer, scene, image, "--stats", stats};
+	args.insert(args.end(), opt.raytracer_args.begin(), opt.raytracer_args.end());
+	vector<char *> argv;
+	for (auto &it : args)
+		argv.push_back(const_cast<char *>(it.c_str()));
+	argv.push_back(nullptr);
+
+	auto start = chrono::steady_clock::now();
+	pid_t pid = fork();
+	if (pid < 0)
+		return result;
+	if (pid == 0) {
+		if (chdir(scene_dir.c_str()) != 0)
+			_exit(127);
+		// keep the raytracer's progress lines out of the report
+		if (!freopen("/dev/null", "w", stderr))
+			_exit(127);
+		execv(argv[0], argv.data());
+		_exit(127);
+	}
+	int status = 0;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) != pid)
+		return result;
+	result.wall_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	result.peak_rss_kb = usage.ru_maxrss;
+	result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+	ifstream fin(stats);
+	stringstream text;
+	text << fin.rdbuf();
+	result.rays = json_number(text.str(), "rays");
+	result.rays_per_second = json_number(text.str(), "rays_per_second");
+	result.render_seconds = json_number(text.str(), "render");
+	result.width = json_number(text.str(), "width");
+	result.height = json_number(text.str(), "height");
+	return result;
+}
+
+// PSNR (peak 1.0) and largest per-channel difference of two PNGs.
+Comparison compare_images(const string &image, const string &reference) {
+	Comparison cmp;
+	pngwriter a, b;
+	a.readfromfile(const_cast<char *>(image.c_str()));
+	b.readfromfile(const_cast<char *>(reference.c_str()));
+	int width = a.getwidth(), height = a.getheight();
+	if (width <= 1 || width != b.getwidth() || height != b.getheight())
+		return cmp;
+	double sq_sum = 0.0;
+	for (int y = 1; y <= height; y++) {
+		for (int x = 1; x <= width; x++) {
+			for (int c = 1; c <= 3; c++) {
+				double d = fabs(a.dread(x, y, c) - b.dread(x, y, c));
+				sq_sum += d * d;
+				cmp.max_error = max(cmp.max_error, d);
+			}
+		}
+	}
+	double mse = sq_sum / (3.0 * width * height);
+	cmp.psnr = mse > 0.0 ? 10.0 * log10(1.0 / mse) : INFINITY;
+	cmp.compared = true;
+	return cmp;
+}
+
+bool file_exists(const string &path) {
+	struct stat st;
+	return stat(path.c_str(), &st) == 0;
+}
+
+void append_history(const Options &opt, const string &scene, const RunResult &run,
+                    const Comparison &cmp, const string &status) {
+	bool new_file = !file_exists(opt.history);
+	ofstream out(opt.history, ios::app);
+	if (!out) {
+		cerr << "Cannot write history file: " << opt.history << endl;
+		return;
+	}
+	if (new_file) {
+		out << "timestamp,label,scene,width,height,wall_seconds,render_seconds,rays,rays_per_second,"
+		    << "peak_rss_kb,psnr,max_error,status" << endl;
+	}
+	char stamp[32];
+	time_t now = time(nullptr);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+	out << stamp << "," << opt.label << "," << scene << "," << run.width << "," << run.height << ","
+	    << run.wall_seconds << "," << run.render_seconds << "," << (long long)run.rays << ","
+	    << run.rays_per_second << "," << run.peak_rss_kb << ",";
+	if (cmp.compared)
+		out << cmp.psnr << "," << cmp.max_error;
+	else
+		out << ",";
+	out << "," << status << endl;
+}
+
+// Renders, checks and records each scene; returns the number of failures.
+int run_scenes(const Options &opt, const string &scene_dir, const vector<string> &scenes) {
+	mkdir(opt.out.c_str(), 0755);
+	string out_dir = absolute_path(opt.out);
+	int failures = 0;
+	printf("%-28s %9s %12s %10s %8s %9s  %s\n", "scene", "wall s", "rays/s", "rss MB", "psnr", "max err", "status");
+	for (auto &scene : scenes) {
+		string name = scene.substr(0, scene.size() - 3);
+		string image = out_dir + "/" + name + ".png";
+		string stats = out_dir + "/" + name + ".json";
+		remove(stats.c_str());
+		RunResult run = run_raytracer(opt, scene_dir, scene, image, stats);
+
+		Comparison cmp;
+		string reference = scene_dir + "/" + name + ".png";
+		string status = "ok";
+		if (!run.ok) {
+			status = "crashed";
+		} else if (file_exists(reference)) {
+			cmp = compare_images(image, reference);
+			if (!cmp.compared)
+				status = "size-mismatch";
+			else if (cmp.psnr < opt.min_psnr || cmp.max_error > opt.max_error)
+				status = "image-regression";
+		}
+		if (status != "ok")
+			failures++;
+		printf("%-28s %9.3f %12.0f %10.1f ", scene.c_str(), run.wall_seconds, run.rays_per_second,
+		       run.peak_rss_kb / 1024.0);
+		if (cmp.compared)
+			printf("%8.2f %9.4f  %s\n", cmp.psnr, cmp.max_error, status.c_str());
+		else
+			printf("%8s %9s  %s\n", "-", "-", status.c_str());
+		append_history(opt, scene, run, cmp, status);
+	}
+	return failures;
+}
+
+/**
+ * Renders each scene with the double and the float build and checks the
+ * float image against the double one, so the tolerance measures what
+ * float precision costs rather than drift from the stored references.
+ * Returns the number of scenes that crashed or fell outside it.
+ */
+int compare_precision(const Options &opt, const string &scene_dir, const vector<string> &scenes) {
+	mkdir(opt.out.c_str(), 0755);
+	string out_dir = absolute_path(opt.out);
+	Options as_double = opt, as_float = opt;
+	as_double.label = opt.label.empty() ? "double" : opt.label + "-double";
+	as_float.label = opt.label.empty() ? "float" : opt.label + "-float";
+	as_float.raytracer = opt.float_raytracer;
+	int failures = 0;
+	double double_total = 0.0, float_total = 0.0;
+	printf("%-28s %9s %9s %8s %12s %12s %8s %9s  %s\n", "scene", "double s", "float s", "speedup",
+	       "double ray/s", "float ray/s", "psnr", "max err", "status");
+	for (auto &scene : scenes) {
+		string name = scene.substr(0, scene.size() - 3);
+		string stats = out_dir + "/" + name + ".json";
+		string double_image = out_dir + "/" + name + ".double.png";
+		string float_image = out_dir + "/" + name + ".float.png";
+		remove(stats.c_str());
+		RunResult run_double = run_raytracer(as_double, scene_dir, scene, double_image, stats);
+		remove(stats.c_str());
+		RunResult run_float = run_raytracer(as_float, scene_dir, scene, float_image, stats);
+
+		Comparison cmp;
+		string status = "ok";
+		if (!run_double.ok || !run_float.ok) {
+			status = "crashed";
+		} else {
+			cmp = compare_images(float_image, double_image);
+			if (!cmp.compared)
+				status = "size-mismatch";
+			else if (cmp.psnr < opt.min_psnr || cmp.max_error > opt.max_error)
+				status = "out-of-tolerance";
+		}
+		if (status != "ok")
+			failures++;
+		double_total += run_double.wall_seconds;
+		float_total += run_float.wall_seconds;
+		printf("%-28s %9.3f %9.3f %7.2fx %12.0f %12.0f ", scene.c_str(), run_double.wall_seconds,
+		       run_float.wall_seconds, run_double.wall_seconds / max(run_float.wall_seconds, 1e-9),
+		       run_double.rays_per_second, run_float.rays_per_second);
+		if (cmp.compared)
+			printf("%8.2f %9.4f  %s\n", cmp.psnr, cmp.max_error, status.c_str());
+		else
+			printf("%8s %9s  %s\n", "-", "-", status.c_str());
+		append_history(as_double, scene, run_double, Comparison(), run_double.ok ? "ok" : "crashed");
+		append_history(as_float, scene, run_float, cmp, status);
+	}
+	printf("%-28s %9.3f %9.3f %7.2fx\n", "total", double_total, float_total,
+	       double_total / max(float_total, 1e-9));
+	return failures;
+}
+
+vector<string> list_scenes(const string &dir) {
+	vector<string> scenes;
+	DIR *d = opendir(dir.c_str());
+	if (!d)
+		return scenes;
+	while (struct dirent *entry = readdir(d)) {
+		string name = entry->d_name;
+		if (name.size() > 3 && name.compare(name.size() - 3, 3, ".in") == 0)
+			scenes.push_back(name);
+	}
+	closedir(d);
+	sort(scenes.begin(), scenes.end());
+	return scenes;
+}
+
+// Camera and lights shared by the synthetic scenes: a view down -z that
+// frames the box [-1, 1] x [-1, 1] x [-4, -2].
+void write_scene_header(ostream &out) {
+	out << "cam 0 0 1 -.3 -.3 0 .3 -.3 0 -.3 .3 0 .3 .3 0" << endl;
+	out << "ltd -1 -1 -1 .6 .6 .6" << endl;
+	out << "ltp 2 2 0 .5 .5 .5 0" << endl;
+	out << "lta .1 .1 .1" << endl;
+}
+
+bool generate_spheres(int n, const string &path) {
+	ofstream out(path);
+	if (!out)
+		return false;
+	write_scene_header(out);
+	mt19937 rng(184);
+	uniform_real_distribution<double> unit(0.0, 1.0);
+	double radius = 0.5 / cbrt((double)n);
+	for (int i = 0; i < n; i++) {
+		out << "mat .1 .1 .1 " << unit(rng) << " " << unit(rng) << " " << unit(rng)
+		    << " .5 .5 .5 20 .2 .2 .2" << endl;
+		out << "sph " << 2.0 * unit(rng) - 1.0 << " " << 2.0 * unit(rng) - 1.0 << " "
+		    << -2.0 - 2.0 * unit(rng) << " " << radius * (0.5 + unit(rng)) << endl;
+	}
+	return true;
+}
+
+// A rippled height field of about n triangles, tilted to face the camera.
+bool generate_mesh(int n, const string &path) {
+	string obj_path = path.substr(0, path.rfind('.')) + ".obj";
+	string obj_name = obj_path.substr(obj_path.rfind('/') + 1);
+	ofstream out(path), obj(obj_path);
+	if (!out || !obj)
+		return false;
+	write_scene_header(out);
+	out << "mat .1 .1 .1 .7 .6 .5 .4 .4 .4 30 .3 .3 .3" << endl;
+	out << "obj " << obj_name << endl;
+	out << "mat .1 .1 .1 .2 .3 .8 .5 .5 .5 50 .5 .5 .5" << endl;
+	out << "sph .4 .3 -2.6 .25" << endl;
+
+	int k = max(1, (int)sqrt(n / 2.0));
+	for (int j = 0; j <= k; j++) {
+		for (int i = 0; i <= k; i++) {
+			double u = 2.0 * i / k - 1.0, v = 2.0 * j / k - 1.0;
+			double h = 0.08 * sin(9.0 * u) * cos(7.0 * v);
+			obj << "v " << 1.2 * u << " " << 0.6 * v - 0.3 + h << " " << -3.0 + 0.8 * v << "\n";
+		}
+	}
+	for (int j = 0; j < k; j++) {
+		for (int i = 0; i < k; i++) {
+			int a = j * (k + 1) + i + 1, b = a + 1, c = a + k + 1, d = c + 1;
+			obj << "f " << a << " " << b << " " << d << "\n";
+			obj << "f " << a << " " << d << " " << c << "\n";
+		}
+	}
+	return true;
+}
+
+bool generate(const string &kind, int n, const string &path) {
+	if (kind == "spheres")
+		return generate_spheres(n, path);
+	if (kind == "mesh")
+		return generate_mesh(n, path);
+	cerr << "Unknown scene kind: " << kind << endl;
+	return false;
+}
+
+// Parses run options from argv[first...]; everything after "--" goes to
+// the raytracer. Returns false on an unknown option.
+bool parse_options(int argc, char *argv[], int first, Options *opt, vector<string> *rest) {
+	for (int i = first; i < argc; i++) {
+		string arg(argv[i]);
+		if (arg == "--") {
+			opt->raytracer_args.assign(argv + i + 1, argv + argc);
+			break;
+		} else if (arg == "--raytracer" && i + 1 < argc) {
+			opt->raytracer = argv[++i];
+		} else if (arg == "--float-raytracer" && i + 1 < argc) {
+			opt->float_raytracer = argv[++i];
+		} else if (arg == "--scenes" && i + 1 < argc) {
+			opt->scenes = argv[++i];
+		} else if (arg == "--out" && i + 1 < argc) {
+			opt->out = argv[++i];
+		} else if (arg == "--history" && i + 1 < argc) {
+			opt->history = argv[++i];
+		} else if (arg == "--label" && i + 1 < argc) {
+			opt->label = argv[++i];
+		} else if (arg == "--min-psnr" && i + 1 < argc) {
+			opt->min_psnr = atof(argv[++i]);
+		} else if (arg == "--max-error" && i + 1 < argc) {
+			opt->max_error = atof(argv[++i]);
+		} else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+			cerr << "Unknown option: " << arg << endl;
+			return false;
+		} else {
+			rest->push_back(arg);
+		}
+	}
+	opt->raytracer = absolute_path(opt->raytracer);
+	opt->float_raytracer = absolute_path(opt->float_raytracer);
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	string command = argc > 1 ? argv[1] : "run";
+	Options opt;
+	vector<string> rest;
+	if (!parse_options(argc, argv, argc > 1 ? 2 : 1, &opt, &rest))
+		return 2;
+
+	if (command == "run") {
+		vector<string> scenes = list_scenes(opt.scenes);
+		if (scenes.empty()) {
+			cerr << "No .in scenes in " << opt.scenes << endl;
+			return 2;
+		}
+		int failures = run_scenes(opt, absolute_path(opt.scenes), scenes);
+		printf("%d of %d scenes failed.\n", failures, (int)scenes.size());
+		return failures > 0 ? 1 : 0;
+	} else if (command == "precision") {
+		vector<string> scenes = list_scenes(opt.scenes);
+		if (scenes.empty()) {
+			cerr << "No .in scenes in " << opt.scenes << endl;
+			return 2;
+		}
+		int failures = compare_precision(opt, absolute_path(opt.scenes), scenes);
+		printf("%d of %d scenes failed.\n", failures, (int)scenes.size());
+		return failures > 0 ? 1 : 0;
+	} else if (command == "generate" && rest.size() == 3) {
+		return generate(rest[0], atoi(rest[1].c_str()), rest[2]) ? 0 : 1;
+	} else if (command == "scaling" && rest.size() >= 2) {
+		string scene_dir = opt.out;
+		mkdir(scene_dir.c_str(), 0755);
+		vector<string> scenes;
+		for (size_t i = 1; i < rest.size(); i++) {
+			string name = rest[0] + "_" + rest[i] + ".in";
+			if (!generate(rest[0], atoi(rest[i].c_str()), scene_dir + "/" + name))
+				return 1;
+			scenes.push_back(name);
+		}
+		opt.out = scene_dir + "/render";
+		return run_scenes(opt, absolute_path(scene_dir), scenes) > 0 ? 1 : 0;
+	}
+	cerr << "Usage: benchmark run|generate|scaling|precision ... (see benchmark.cpp)" << endl;
+	return 2;
+}
@@ -5,17 +5,89 @@
  * cam ex ey ez llx lly llz lrx lry lrz ulx uly ulz urx ury urz
  * sph cx cy cz r
  * tri ax ay az bx by bz cx cy cz
- * obj "filename"
+ * obj "filename" -> placed with the current transformation; repeated files are loaded once
  * ltp px py pz r g b [falloff=0,1,2 for none, linear, quadratic]
  * ltd dx dy dz r g b
  * lta r g b
- * mat kar kag kab kdr kdg kdb ksr ksg ksb ksp krr krg krb
+ * mat kar kag kab kdr kdg kdb ksr ksg ksb ksp krr krg krb [max_bounces]
+ *     -> max_bounces limits the bounces of rays reflected off the material,
+ *        0 for none; by default the scene's depth applies
+ * size width height
+ * depth max_depth
+ * crop x0 y0 x1 y1 -> render only this window (pixels, origin top left, x1 y1 exclusive)
+ *
+ * Animation:
+ * frames n -> render frames 0 to n-1
+ * kfc frame ex ey ez llx lly llz lrx lry lrz ulx uly ulz urx ury urz -> camera keyframe
+ * kfo frame tx ty tz rx ry rz s -> keyframe for the object of the last sph, tri or
+ *     obj directive (an error if that created none): translation,
+ *     rotation (as xfr) and uniform scale about the object's center
  *
  * Tranformations:
  * xft tx ty tz -> translation
  * xfr rx ry rz -> rotation
  * xfs sx sy sz -> scaling
  * xfz -> reset to identity
+ *
+ * Command line:
+ * raytracer [input.in] [output.png] [--threads N] [--packets] [--packet-isa sse|avx2|avx512] [--wavefront]
+ *           [--min-samples N] [--max-samples N] [--aa-threshold T]
+ *           [--progressive] [--checkpoint FILE] [--checkpoint-interval SECONDS] [--resume]
+ *           [--width W] [--height H] [--depth D] [--crop x0,y0,x1,y1]
+ *           [--stats FILE|-]
+ *           [--workers N] [--worker-command CMD]... [--tile-retries R] [--tile-timeout SECONDS]
+ *           [--frames N] [--out-of-core MB] [--min-throughput T] [--roulette]
+ *           [--compile FILE]
+ *
+ * --compile FILE parses the scene, builds its BVH and writes it all to FILE
+ * in binary, then exits. FILE can be given in place of the .in file and
+ * loads without any parsing or building. Size, depth and crop options at
+ * compile time are stored with it; keyframed scenes cannot be compiled.
+ *
+ * Size, depth and crop options override the scene's directives. The
+ * output image covers just the crop window.
+ *
+ * --wavefront traces the center samples breadth first: all rays of a bounce
+ * are kept in queues and each stage of trace() (closest hit, shadow rays,
+ * shading, reflection) runs over a whole queue at once. Depth is a loop,
+ * not recursion. Extra AA samples and --progressive are still traced ray
+ * by ray.
+ *
+ * Reflection rays are only traced where they can change the pixel: not off
+ * surfaces with zero reflectance, nor where the direct light already
+ * saturates every reflective channel. --min-throughput T also cuts paths
+ * whose weight in the pixel has dropped below T; with --roulette they go
+ * on at random instead, weighted so the mean is kept (default T 0.1).
+ *
+ * --stats writes ray and intersection counters and phase timings as JSON.
+ *
+ * With --max-samples above 1, pixels whose luminance differs from a
+ * neighbour's by more than T get extra samples until the standard error of
+ * their mean luminance drops below T or they reach the maximum.
+ *
+ * --workers N renders the image in N local worker processes, and each
+ * --worker-command adds one more worker started through the shell, with
+ * the worker arguments appended, e.g. "ssh render2 ./raytracer";
+ * that host needs the same scene files. A job that fails is retried on
+ * another worker up to R times (default 3); --tile-timeout also fails jobs
+ * that take longer than SECONDS. --worker is the worker side, speaking
+ * over stdin and stdout.
+ *
+ * With more than one frame, frame f is written to the output name with
+ * _ffff (or f through a printf pattern such as frame%03d.png) inserted.
+ * The scene is parsed and meshes loaded once; per frame only the camera
+ * and the keyframed objects move, and the BVH is refit rather than
+ * rebuilt.
+ *
+ * --out-of-core MB renders meshes from disk instead of memory. Each .obj is
+ * converted once to a .chunks file beside it (redone when the .obj
+ * changes), holding the faces in spatially coherent chunks with their own
+ * BVHs; chunks are mapped when rays reach them and the least recently used
+ * are unmapped to keep at most MB megabytes of mesh data mapped.
+ *
+ * --progressive renders every 8th pixel first, then fills in, then runs the
+ * AA pass, saving a checkpoint (default output.png.ckpt) every 30 seconds
+ * and when interrupted. --resume continues from that checkpoint.
  */
 
 #include <iostream>
@@ -23,249 +95,1656 @@
 #include <vector>
 #include <cmath>
 #include <algorithm>
+#include <chrono>
 #include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <map>
+#include <memory>
 #include <sstream>
+#include <string_view>
+#include "Animation.h"
+#include "BVH.h"
+#include "Checkpoint.h"
+#include "ChunkedMesh.h"
 #include "Light.h"
 #include "GeoObject.h"
+#include "TileScheduler.h"
+#include "TriangleMesh.h"
 #include "Camera.h"
+#include "Framebuffer.h"
+#include "MappedFile.h"
 #include "Material.h"
+#include "Primitives.h"
+#include "ObjLoader.h"
+#include "TextScanner.h"
+#include "RenderStats.h"
+#include "Sampler.h"
+#include "SceneCache.h"
 #include "Vector.h"
 #include "Transformation.h"
+#include "Wavefront.h"
+#include "WorkerProcess.h"
 #include "pngwriter/src/pngwriter.h"
 
 using namespace std;
 
-void load_mesh(const string &obj_filename, const Material &mtrl);
-
-typedef pair<int, int> pii;
+shared_ptr<GeoObject> load_mesh(const string &obj_filename);
 
+// Scene objects in scene order. Once the world BVH is built they are
+// moved into `primitives`, which owns them from then on.
 vector<GeoObject *> world_objects;
+PrimitiveArrays primitives;
 vector<Light *> world_lights;
+BVH world_bvh;
+
+const int TILE_SIZE = 16;
+const int SAMPLE_BATCH = 4;
+const int PROGRESSIVE_STRIDE = 8;
+
+int image_width = 1000;
+int image_height = 1000;
+int max_depth = 3;
+// Window of the image that is rendered, as in the crop directive. Without
+// a crop directive or option it is the whole image.
+int crop_x0 = 0, crop_y0 = 0, crop_x1 = 0, crop_y1 = 0;
+bool has_crop = false;
+
+int num_threads = TileScheduler::default_threads();
+bool use_packets = false;
+bool use_wavefront = false;
+// Paths whose throughput falls below this are cut, or with use_roulette
+// continued at random.
+double min_throughput = 0.0;
+bool use_roulette = false;
+const int WAVEFRONT_PATHS = 1 << 16; // pixels traced together in wavefront mode
+const int WAVEFRONT_GRAIN = 256;     // queue entries per scheduled run of a stage
+int min_samples = 1;
+int max_samples = 1;
+double aa_threshold = 0.05;
+long samples_spent = 0;
+bool progressive = false;
+bool resume = false;
+string checkpoint_filename;
+double checkpoint_interval = 30.0;
+
+int num_frames = 1;
+// Megabytes of mesh chunks kept mapped in out-of-core mode; 0 loads meshes
+// into memory.
+int out_of_core_mb = 0;
+CameraTrack camera_track;
+map<int, MotionTrack> object_tracks; // by index into world_objects
+vector<AnimatedObject *> animated_objects;
 
-const int HEIGHT = 1000;
-const int WIDTH = 1000;
-const int DEPTH = 3;
+const int JOB_SIZE = 64;   // side of the image region a worker renders per request
+const int JOB_DEPTH = 2;   // requests queued at each worker, to hide the round trip
+int num_workers = 0;
+vector<string> worker_commands;
+int tile_retries = 3;
+double tile_timeout = 0.0;
+
+// Reads n numbers off the rest of a directive line.
+bool read_numbers(TextScanner &line, double *out, int n) {
+	for (int i = 0; i < n; i++) {
+		if (!line.number(&out[i]))
+			return false;
+	}
+	return true;
+}
 
 void parse_input(const string &filename) {
-	ifstream fin(filename);
-	string line, type, obj_filename;
-	Material mtrl;
+	MappedFile file(filename);
+	if (!file.is_open()) {
+		cerr << "Cannot open input file: " << filename << endl;
+		return;
+	}
+	auto start = chrono::steady_clock::now();
+	double mesh_seconds = 0.0; // spent loading .obj files, which report their own
+	TextScanner text(file.begin(), file.end()), line;
+	string_view type;
+	MaterialId mtrl = 0;
     Transformation trans;
+	// index in world_objects of the object the last sph, tri or obj
+	// directive created; -1 if it created none
+	int last_object = -1;
 
-	while (getline(fin, line)) {
-		if (line.empty())
+	while (text.next_line(&line)) {
+		if (!line.word(&type))
 			continue;
-		stringstream ss;
-		ss << line;
-		ss >> type;
 
         bool valid_type = true;
+        double v[16];
 		if (type == "cam") {
-			double ex, ey, ez, llx, lly, llz, lrx, lry, lrz, ulx, uly, ulz, urx, ury, urz;
-			ss >> ex >> ey >> ez >> llx >> lly >> llz >> lrx >> lry >> lrz >> ulx >> uly >> ulz >> urx >> ury >> urz;
-			Camera::instance()->init(ex, ey, ez, llx, lly, llz, lrx, lry, lrz, ulx, uly, ulz, urx, ury, urz);
+			valid_type = read_numbers(line, v, 15);
+			if (valid_type)
+				Camera::instance()->init(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8],
+				                         v[9], v[10], v[11], v[12], v[13], v[14]);
 		} else if (type == "sph") {
-			double x, y, z, rad;
-			ss >> x >> y >> z >> rad;
-			GeoObject *sph = new Ellipsoid(x, y, z, rad, mtrl, trans);
-			world_objects.push_back(sph);
+			valid_type = read_numbers(line, v, 4);
+			last_object = valid_type ? (int)world_objects.size() : -1;
+			double scale;
+			if (valid_type && trans.mat.uniform_scale(&scale)) {
+				// still round, so the plain sphere test will do
+				Vector center = trans.apply(Vector(v[0], v[1], v[2]));
+				world_objects.push_back(new Sphere(center.x, center.y, center.z, v[3] * scale, mtrl));
+			} else if (valid_type) {
+				world_objects.push_back(new Ellipsoid(v[0], v[1], v[2], v[3], mtrl, trans));
+			}
 		} else if (type == "tri") {
-			double ax, ay, az, bx, by, bz, cx, cy, cz;
-			ss >> ax >> ay >> az >> bx >> by >> bz >> cx >> cy >> cz;
-			GeoObject *tri = new Triangle(ax, ay, az, bx, by, bz, cx, cy, cz, mtrl);
-			world_objects.push_back(tri);
+			valid_type = read_numbers(line, v, 9);
+			last_object = valid_type ? (int)world_objects.size() : -1;
+			if (valid_type)
+				world_objects.push_back(new Triangle(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], mtrl));
 		} else if (type == "obj") {
 			// read .obj file
-			ss >> obj_filename;
-			load_mesh(obj_filename, mtrl);
+			string_view obj_filename;
+			valid_type = line.word(&obj_filename);
+			last_object = -1;
+			if (valid_type) {
+				auto mesh_start = chrono::steady_clock::now();
+				shared_ptr<GeoObject> mesh = load_mesh(string(obj_filename));
+				mesh_seconds += chrono::duration<double>(chrono::steady_clock::now() - mesh_start).count();
+				if (mesh) {
+					last_object = world_objects.size();
+					world_objects.push_back(new MeshInstance(mesh, mtrl, trans));
+				}
+			}
 		} else if (type == "ltp") {
-			double px, py, pz, r, g, b;
-			int falloff;
-			ss >> px >> py >> pz >> r >> g >> b >> falloff;
-			Light *pl = new PointLight(px, py, pz, r, g, b, falloff);
-            world_lights.push_back(pl);
+			valid_type = read_numbers(line, v, 6);
+			int falloff = 0;
+			if (valid_type && !line.at_end())
+				valid_type = line.integer(&falloff);
+			if (valid_type)
+				world_lights.push_back(new PointLight(v[0], v[1], v[2], v[3], v[4], v[5], falloff));
 		} else if (type == "ltd") {
-			double dx, dy, dz, r, g, b;
-			ss >> dx >> dy >> dz >> r >> g >> b;
-			Light *dl = new DirectionalLight(dx, dy, dz, r, g, b);
-            world_lights.push_back(dl);
+			valid_type = read_numbers(line, v, 6);
+			if (valid_type)
+				world_lights.push_back(new DirectionalLight(v[0], v[1], v[2], v[3], v[4], v[5]));
 		} else if (type == "lta") {
-			double r, g, b;
-			ss >> r >> g >> b;
-			Light *al = new AmbientLight(r, g, b);
-            world_lights.push_back(al);
+			valid_type = read_numbers(line, v, 3);
+			if (valid_type)
+				world_lights.push_back(new AmbientLight(v[0], v[1], v[2]));
         } else if (type == "lts") {
-        	double px, py, pz, dx, dy, dz, r, g, b, beam, falloff;
-        	ss >> px >> py >> pz >> dx >> dy >> dz >> r >> g >> b >> beam >> falloff;
-        	Light *sl = new SpotLight(px, py, pz, dx, dy, dz, r, g, b, beam, falloff);
-        	world_lights.push_back(sl);
+        	valid_type = read_numbers(line, v, 11);
+        	if (valid_type)
+        		world_lights.push_back(new SpotLight(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9], v[10]));
 		} else if (type == "mat") {
-			double kar, kag, kab, kdr, kdg, kdb, ksr, ksg, ksb, ksp, krr, krg, krb;
-			ss >> kar >> kag >> kab >> kdr >> kdg >> kdb >> ksr >> ksg >> ksb >> ksp >> krr >> krg >> krb;
-			mtrl = Material(kar, kag, kab, kdr, kdg, kdb, ksr, ksg, ksb, ksp, krr, krg, krb);
+			valid_type = read_numbers(line, v, 13);
+			Material material(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9], v[10], v[11], v[12]);
+			if (valid_type && !line.at_end())
+				valid_type = line.integer(&material.max_bounces);
+			if (valid_type)
+				mtrl = MaterialTable::instance().intern(material);
 		} else if (type.length() == 3 && type[0] == 'x' && type[1] == 'f') {
-            double x, y, z;
-			if (type[2] == 't') {
-                // translation
-                ss >> x >> y >> z;
-                Translation trans_cur(x, y, z);
-                trans.chain(trans_cur, 0);
-			} else if (type[2] == 'r') {
-                // rotation
-                ss >> x >> y >> z;
-                Rotation trans_cur(x, y, z);
-                trans.chain(trans_cur, 1);
-			} else if (type[2] == 's') {
-                // scale
-                ss >> x >> y >> z;
-                Scaling trans_cur(x, y, z);
-                trans.chain(trans_cur, 2);
-			} else if (type[2] == 'z') {
+			if (type[2] == 'z') {
 				trans.reset();
+			} else {
+				valid_type = read_numbers(line, v, 3);
+				if (valid_type && type[2] == 't') {
+					// translation
+					trans.chain(Translation(v[0], v[1], v[2]), 0);
+				} else if (valid_type && type[2] == 'r') {
+					// rotation
+					trans.chain(Rotation(v[0], v[1], v[2]), 1);
+				} else if (valid_type && type[2] == 's') {
+					// scale
+					trans.chain(Scaling(v[0], v[1], v[2]), 2);
+				}
+			}
+		} else if (type == "size") {
+			valid_type = read_numbers(line, v, 2) && v[0] >= 1 && v[1] >= 1;
+			if (valid_type) {
+				image_width = v[0];
+				image_height = v[1];
+			}
+		} else if (type == "depth") {
+			valid_type = read_numbers(line, v, 1) && v[0] >= 1;
+			if (valid_type)
+				max_depth = v[0];
+		} else if (type == "crop") {
+			valid_type = read_numbers(line, v, 4);
+			if (valid_type) {
+				crop_x0 = v[0];
+				crop_y0 = v[1];
+				crop_x1 = v[2];
+				crop_y1 = v[3];
+				has_crop = true;
 			}
+		} else if (type == "frames") {
+			valid_type = read_numbers(line, v, 1) && v[0] >= 1;
+			if (valid_type)
+				num_frames = v[0];
+		} else if (type == "kfc") {
+			valid_type = read_numbers(line, v, 16) && v[0] >= 0;
+			if (valid_type)
+				camera_track.add(v[0], v + 1);
+		} else if (type == "kfo") {
+			if (last_object < 0) {
+				cerr << "Keyframe without an object: kfo" << endl;
+				continue;
+			}
+			valid_type = read_numbers(line, v, 8) && v[0] >= 0;
+			if (valid_type)
+				object_tracks[last_object].add(v[0], v + 1);
 		} else if (type == "#") {
-            return;
+            break;
         } else {
 			cerr << "Unknown specification type: " << type << endl;
-            valid_type = false;
+			continue;
 		}
-        if (valid_type) {
-            string extra;
-            getline(ss, extra);
-            if (!extra.empty()) {
-                cerr << "Extra parameters:" << extra << endl;
-            }
+        if (!valid_type) {
+            cerr << "Missing or malformed parameters: " << type << endl;
+            continue;
+        }
+        string_view extra = line.rest();
+        if (!extra.empty()) {
+            cerr << "Extra parameters: " << extra << endl;
         }
 	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count() - mesh_seconds;
+	cerr << "Loaded " << filename << ": " << file.size / (1024.0 * 1024.0) << " MB in "
+	     << seconds << " s (" << file.size / (1024.0 * 1024.0) / seconds << " MB/s)" << endl;
 }
 
-void load_mesh(const string &obj_filename, const Material &mtrl) {
-    ifstream fin(obj_filename);
-    vector<Vector> vertices;
-    string line, type;
-	while (getline(fin, line)) {
-		if (line.empty())
-			continue;
-		stringstream ss;
-		ss << line;
-		ss >> type;
-
-		if (type[0] == 'v') {
-			double x, y, z;
-			ss >> x >> y >> z;
-			vertices.emplace_back(x, y, z);
-		} else if (type[0] == 'f') {
-			int x, y, z;
-			ss >> x >> y >> z;
-			GeoObject *tri = new Triangle(vertices[x - 1], vertices[y - 1], vertices[z - 1], mtrl);
-			world_objects.push_back(tri);
-		} else if (type[0] == '#') {
-			continue;
-		} else {
-			cerr << "Unknown type encountered in .obj file: " << obj_filename << endl;
+// Meshes by file name; every obj directive naming the same file shares one.
+map<string, shared_ptr<GeoObject>> mesh_cache;
+
+// Opens the chunk file of an .obj, converting the .obj first if the chunk
+// file is missing or stale. The conversion still reads the whole .obj into
+// memory once; rendering afterwards does not.
+shared_ptr<GeoObject> load_chunked_mesh(const string &obj_filename) {
+	string chunk_filename = obj_filename + ".chunks";
+	if (!MeshChunks::up_to_date(chunk_filename, obj_filename)) {
+		ObjData obj;
+		if (!load_obj(obj_filename, &obj, num_threads)) {
+			cerr << "Cannot open .obj file: " << obj_filename << endl;
+			return nullptr;
+		}
+		if (!MeshChunks::convert(obj, obj_filename, chunk_filename)) {
+			cerr << "Cannot write mesh chunks: " << chunk_filename << endl;
+			return nullptr;
 		}
+		cerr << "Converted " << obj_filename << " to " << chunk_filename << endl;
+	}
+	auto mesh = make_shared<ChunkedMesh>();
+	if (!mesh->open(chunk_filename)) {
+		cerr << "Cannot read mesh chunks: " << chunk_filename << endl;
+		return nullptr;
+	}
+	cerr << "Opened " << chunk_filename << ": " << mesh->num_faces << " faces in "
+	     << mesh->num_chunks() << " chunks" << endl;
+	return mesh;
+}
+
+// Loads an .obj file, or returns the mesh loaded from it before. Returns
+// null if the file cannot be read or has no faces.
+shared_ptr<GeoObject> load_mesh(const string &obj_filename) {
+	auto cached = mesh_cache.find(obj_filename);
+	if (cached != mesh_cache.end())
+		return cached->second;
+	shared_ptr<GeoObject> &cached_mesh = mesh_cache[obj_filename];
+	if (out_of_core_mb > 0)
+		return cached_mesh = load_chunked_mesh(obj_filename);
+	ObjData obj;
+	if (!load_obj(obj_filename, &obj, num_threads)) {
+		cerr << "Cannot open .obj file: " << obj_filename << endl;
+		return nullptr;
+	}
+	cerr << "Loaded " << obj_filename << ": " << obj.num_vertices() << " vertices, "
+	     << obj.num_faces() << " faces, " << obj.bytes / (1024.0 * 1024.0) << " MB in "
+	     << obj.seconds << " s (" << obj.mb_per_sec() << " MB/s)" << endl;
+	if (obj.bad_faces > 0)
+		cerr << "Skipped " << obj.bad_faces << " bad faces in .obj file: " << obj_filename << endl;
+	if (obj.unknown_lines > 0)
+		cerr << "Unknown type encountered in .obj file: " << obj_filename << endl;
+
+	auto mesh = make_shared<TriangleMesh>();
+	for (int i = 0; i < obj.num_vertices(); i++)
+		mesh->add_vertex(obj.vertices[3 * i], obj.vertices[3 * i + 1], obj.vertices[3 * i + 2]);
+	for (int f = 0; f < obj.num_faces(); f++) {
+		// polygons are split into a fan around their first vertex
+		const int *idx = &obj.indices[obj.face_start[f]];
+		int n = obj.face_start[f + 1] - obj.face_start[f];
+		for (int k = 2; k < n; k++)
+			mesh->add_face(idx[0], idx[k - 1], idx[k]);
+	}
+	if (mesh->num_faces() == 0)
+		return nullptr;
+	mesh->finalize();
+	return cached_mesh = mesh;
+}
+
+// Loads a scene written by --compile, BVH included.
+bool load_compiled(const string &filename) {
+	SceneCache::Settings settings;
+	string error;
+	if (!SceneCache::read(filename, &settings, &world_objects, &world_lights, &world_bvh, &error)) {
+		cerr << "Cannot load compiled scene " << filename << ": " << error << endl;
+		return false;
+	}
+	image_width = settings.width;
+	image_height = settings.height;
+	max_depth = settings.depth;
+	crop_x0 = settings.crop[0];
+	crop_y0 = settings.crop[1];
+	crop_x1 = settings.crop[2];
+	crop_y1 = settings.crop[3];
+	// compile_scene() stores no crop as all zeros
+	has_crop = crop_x0 != 0 || crop_y0 != 0 || crop_x1 != 0 || crop_y1 != 0;
+	return true;
+}
+
+// Writes the parsed scene and world_bvh, which must be built, for
+// load_compiled().
+bool compile_scene(const string &filename) {
+	if (!camera_track.empty() || !object_tracks.empty()) {
+		cerr << "Keyframed scenes cannot be compiled." << endl;
+		return false;
+	}
+	SceneCache::Settings settings = {image_width, image_height, max_depth,
+	                                 {crop_x0, crop_y0, crop_x1, crop_y1}};
+	// a window over the whole image is stored as none, so that a size
+	// given when rendering still gets the whole image
+	if (crop_x0 == 0 && crop_y0 == 0 && crop_x1 == image_width && crop_y1 == image_height)
+		memset(settings.crop, 0, sizeof(settings.crop));
+	if (!SceneCache::write(filename, settings, world_objects, world_lights, world_bvh)) {
+		cerr << "Cannot write compiled scene: " << filename << endl;
+		return false;
+	}
+	return true;
+}
+
+void build_bvh() {
+    vector<AABB> bounds;
+    bounds.reserve(world_objects.size());
+    for (auto &it : world_objects)
+        bounds.push_back(it->bounds());
+    world_bvh.build(bounds);
+}
+
+// Refits the world BVH to the objects' current bounds.
+void refit_bvh() {
+    vector<AABB> bounds;
+    bounds.reserve(world_objects.size());
+    for (auto &it : world_objects)
+        bounds.push_back(it->bounds());
+    world_bvh.refit(bounds);
+}
+
+// Wraps every object that has keyframes so it can be moved per frame.
+void setup_animation() {
+	for (auto &it : object_tracks) {
+		AnimatedObject *obj = new AnimatedObject(world_objects[it.first], it.second);
+		world_objects[it.first] = obj;
+		animated_objects.push_back(obj);
+	}
+}
+
+// Puts the camera and the keyframed objects where they are at `frame`.
+void set_frame(int frame) {
+	if (!camera_track.empty()) {
+		double v[15];
+		camera_track.sample(frame, v);
+		Camera::instance()->init(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8],
+		                         v[9], v[10], v[11], v[12], v[13], v[14]);
+	}
+	for (auto &obj : animated_objects)
+		obj->set_frame(frame);
+}
+
+// Output file of one frame: through the printf pattern if the name has a
+// '%', else with _ffff inserted before the extension.
+string frame_filename(const string &output_filename, int frame) {
+	char buf[PATH_MAX];
+	if (output_filename.find('%') != string::npos) {
+		snprintf(buf, sizeof(buf), output_filename.c_str(), frame);
+		return buf;
+	}
+	size_t dot = output_filename.rfind('.');
+	if (dot == string::npos || output_filename.find('/', dot) != string::npos)
+		dot = output_filename.size();
+	snprintf(buf, sizeof(buf), "_%04d", frame);
+	return output_filename.substr(0, dot) + buf + output_filename.substr(dot);
+}
+
+// Returns the closest object hit in front of *t, updating *t and *normal.
+GeoObject *intersect_world(const Vector &ray_pos, const Vector &ray_dir, double *t, Vector *normal) {
+    PrimHandle hit;
+    world_bvh.traverse_leaves(ray_pos, ray_dir, t, [&](int first, int count) {
+        primitives.intersect_leaf(first, count, ray_pos, ray_dir, t, normal, &hit);
+        return false;
+    });
+    return primitives.object(hit);
+}
+
+// True if any object blocks the ray before t_max.
+bool occluded_world(const Vector &ray_pos, const Vector &ray_dir, double t_max) {
+    bool hit = false;
+    world_bvh.traverse_leaves(ray_pos, ray_dir, &t_max, [&](int first, int count) {
+        hit = primitives.occluded_leaf(first, count, ray_pos, ray_dir, t_max);
+        return hit;
+    });
+    return hit;
+}
+
+// Frees the scene objects, wherever they are kept.
+void free_objects() {
+	if (primitives.empty()) {
+		for (auto &obj : world_objects)
+			delete obj;
 	}
+	primitives.clear();
+	world_objects.clear();
 }
 
-void write_file(string &output_filename, map<pii, Vector> &image) {
-	pngwriter png(HEIGHT, WIDTH, 0, output_filename.c_str());
+void write_file(string &output_filename, const Framebuffer &image) {
+	pngwriter png(image.width, image.height, 0, output_filename.c_str());
 
-	for (int i = 1; i <= HEIGHT; i++) {
-		for (int j = 1; j <= WIDTH; j++) {
-			Vector v = image[pii(i, j)];
-			png.plot(i, j, v.x, v.y, v.z);
+	for (int y = 0; y < image.height; y++) {
+		for (int x = 0; x < image.width; x++) {
+			const float *p = image.pixel(x, y);
+			png.plot(x + 1, y + 1, (double)p[0], (double)p[1], (double)p[2]);
 		}
 	}
 
 	png.close();
 }
 
-Vector trace(const Vector &ray_pos, const Vector &ray_dir, int depth) {
-    double min_t = INF;
-    GeoObject *intersect_obj = nullptr;
-    Vector intersect_norm;
-    for (auto &it : world_objects) {
-        if (it->intersect(ray_pos, ray_dir, &min_t, &intersect_norm)) {
-            intersect_obj = it;
-        }
-    }
+Vector trace(const Vector &ray_pos, const Vector &ray_dir, int depth, const Vector &throughput);
 
-	Vector color;
-    if (intersect_obj == nullptr)
-    	return color;
+/**
+ * Decides whether a hit reflects, given its material, the depth left, the
+ * throughput of the path so far (the factor its color is weighted by in the
+ * pixel) and the direct light `color` gathered there. No ray is traced when
+ * it could not change the pixel:
+ * - no depth is left, by the scene's depth or the material's max_bounces;
+ * - every channel is either not reflective or already saturated by
+ *   `color`, so the clip would remove what the reflection adds;
+ * - the path's throughput after this bounce is below min_throughput. With
+ *   --roulette such a path instead continues with probability
+ *   throughput / min_throughput and its reflection is weighted up by the
+ *   inverse, which is unbiased before the clip.
+ * On true, the reflected ray is traced to *next_depth and its color scaled
+ * by *weight.
+ */
+bool reflects(const Material &mtrl, int depth, const Vector &throughput, const Vector &color,
+              const Vector &hit_pos, const Vector &reflected, int *next_depth, Vector *weight) {
+	*next_depth = depth - 1;
+	if (mtrl.max_bounces >= 0)
+		*next_depth = min(*next_depth, mtrl.max_bounces);
+	if (*next_depth < 1)
+		return false;
+	const Vector &r = mtrl.reflective;
+	bool visible = (r.x != 0.0 && !(r.x > 0.0 && color.x >= 1.0)) ||
+	               (r.y != 0.0 && !(r.y > 0.0 && color.y >= 1.0)) ||
+	               (r.z != 0.0 && !(r.z > 0.0 && color.z >= 1.0));
+	if (!visible)
+		return false;
+	*weight = r;
+	Vector next = throughput * r;
+	double level = max(max(fabs(next.x), fabs(next.y)), fabs(next.z));
+	if (level >= min_throughput)
+		return true;
+	if (!use_roulette)
+		return false;
+	double survive = level / min_throughput;
+	if (Sampler::ray_unit(hit_pos, reflected) >= survive)
+		return false;
+	*weight = r / survive;
+	return true;
+}
 
+// Color seen along a ray that hits intersect_obj at distance min_t.
+// `throughput` is the weight of this color in the pixel.
+Vector shade(const Vector &ray_pos, const Vector &ray_dir, int depth, const Vector &throughput,
+             GeoObject *intersect_obj, double min_t, const Vector &intersect_norm) {
+	Vector color;
     Vector hit_pos = ray_pos + (ray_dir * min_t);
     // Get intensity from all lights at intersection point.
     for (auto &light_it : world_lights) {
-        // Check if light is blocked by any object
-        Vector blocked_norm;
-        bool has_intersection = false;
-        min_t = INF;
-        for (auto &obj_it : world_objects) {
+        // Ambient light reaches everything; other lights count only if no
+        // object lies between the hit point and the light.
+        if (!light_it->is_ambient) {
             Vector ray_to_light = light_it->direction(hit_pos);
-            has_intersection |= obj_it->intersect(hit_pos + ray_to_light * EPS, ray_to_light, &min_t, &blocked_norm);
-        }
-        Vector hit_vec = ray_dir * min_t;
-        // Only update color if no intersection was encountered, or
-        // is but is further away than the light
-        if (!has_intersection || hit_vec.norm() - light_it->get_dist(hit_pos) > EPS) {
-            // (light, view, hit point)
-            color = color + intersect_obj->get_color(*light_it, -ray_dir, hit_pos, intersect_norm);
+            double light_dist = light_it->get_dist(hit_pos);
+            RenderStats::add(RenderStats::SHADOW_RAYS);
+            if (occluded_world(hit_pos + ray_to_light * RAY_EPS, ray_to_light, light_dist + EPS))
+                continue;
         }
+        // (light, view, hit point)
+        color = color + intersect_obj->get_color(*light_it, -ray_dir, hit_pos, intersect_norm);
     }
 
     if (depth > 1) {
         Vector reflected = ray_dir - 2.0 * intersect_norm.dot(ray_dir) * intersect_norm;
         reflected.normalize();
-        // Add vector by epsilon in direction to ensure no intersection with same object
-        Vector reflected_color = trace(hit_pos + reflected * EPS, reflected, depth - 1) * intersect_obj->mtrl.reflective;;
-        color = color + reflected_color;
+        int next_depth;
+        Vector weight;
+        if (reflects(intersect_obj->material(), depth, throughput, color, hit_pos, reflected, &next_depth, &weight)) {
+            RenderStats::add(RenderStats::REFLECTION_RAYS);
+            // Add vector by epsilon in direction to ensure no intersection with same object
+            Vector reflected_color = trace(hit_pos + reflected * RAY_EPS, reflected, next_depth, throughput * weight) * weight;
+            color = color + reflected_color;
+        }
     }
     return color.clip();
 }
 
-void get_pixels(map<pii, Vector> *image) {
+Vector trace(const Vector &ray_pos, const Vector &ray_dir, int depth, const Vector &throughput) {
+    double min_t = INF;
+    Vector intersect_norm;
+    GeoObject *intersect_obj = intersect_world(ray_pos, ray_dir, &min_t, &intersect_norm);
+    if (intersect_obj == nullptr)
+    	return Vector();
+    return shade(ray_pos, ray_dir, depth, throughput, intersect_obj, min_t, intersect_norm);
+}
+
+/**
+ * Traces a packet of primary rays. The packet kernels only pick the visible
+ * object for each ray in single precision; its hit is then recomputed with
+ * the object's own double precision intersect() and shaded like trace().
+ * Rays the kernels missed or could not decide (RayPacket::uncertain), and
+ * rays whose winner does not confirm the hit, are traced again from
+ * scratch, so the image matches the scalar path.
+ */
+void trace_packet(RayPacket &packet, const Vector *ray_pos, const Vector *ray_dir, Vector *colors) {
+    traverse_packet(world_bvh, packet, [&](int idx) {
+        world_objects[idx]->intersect_packet(packet);
+    });
+    for (int k = 0; k < PACKET_SIZE; k++) {
+        if (!((packet.active >> k) & 1))
+            continue;
+        GeoObject *obj = packet.hit[k];
+        double t = INF;
+        Vector normal;
+        if (obj != nullptr && !((packet.uncertain >> k) & 1) &&
+            obj->intersect(ray_pos[k], ray_dir[k], &t, &normal))
+            colors[k] = shade(ray_pos[k], ray_dir[k], max_depth, Vector(1, 1, 1), obj, t, normal);
+        else
+            colors[k] = trace(ray_pos[k], ray_dir[k], max_depth, Vector(1, 1, 1));
+    }
+}
+
+// Framebuffer pixel (x, y) of the crop window as camera pixel (i, j):
+// 1-based, i from the left and j from the bottom of the full image.
+int pixel_i(int x) {
+	return crop_x0 + x + 1;
+}
+int pixel_j(int y) {
+	return image_height - crop_y1 + y + 1;
+}
+
+// Ray through pixel (i, j) at offset (du, dv) inside it; the default is
+// the pixel center.
+Vector camera_ray(int i, int j, double du = 0.5, double dv = 0.5) {
 	Camera *cam = Camera::instance();
-	for (int i = 1; i <= HEIGHT; i++) {
-		for (int j = 1; j <= WIDTH; j++) {
-			double u = ((HEIGHT - i + 1) - 0.5) / HEIGHT;
-			double v = ((WIDTH - j + 1) - 0.5) / WIDTH;
-			Vector ray_dir = \
-                u * (v * cam->ll + (1.0 - v) * cam->ul) +
-				(1.0 - u) * (v * cam->lr + (1.0 - v) * cam->ur) -
-                cam->loc;
-			ray_dir.normalize();
-
-            Vector color = trace(cam->loc + ray_dir * EPS, ray_dir, DEPTH);
-            image->insert(pair<pii, Vector>(pii(i, j), color));
+	double u = ((image_width - i + 1) - du) / image_width;
+	double v = ((image_height - j + 1) - dv) / image_height;
+	Vector ray_dir = \
+        u * (v * cam->ll + (1.0 - v) * cam->ul) +
+		(1.0 - u) * (v * cam->lr + (1.0 - v) * cam->ur) -
+        cam->loc;
+	ray_dir.normalize();
+	return ray_dir;
+}
+
+Vector render_pixel(int i, int j) {
+	Vector ray_dir = camera_ray(i, j);
+	RenderStats::add(RenderStats::PRIMARY_RAYS);
+    return trace(Camera::instance()->loc + ray_dir * RAY_EPS, ray_dir, max_depth, Vector(1, 1, 1));
+}
+
+// Sample k of pixel (i, j); sample 0 is render_pixel(i, j).
+Vector render_sample(int i, int j, int k) {
+	double du, dv;
+	Sampler::offset(i - 1, j - 1, k, &du, &dv);
+	Vector ray_dir = camera_ray(i, j, du, dv);
+	RenderStats::add(RenderStats::PRIMARY_RAYS);
+    return trace(Camera::instance()->loc + ray_dir * RAY_EPS, ray_dir, max_depth, Vector(1, 1, 1));
+}
+
+// Renders a tile in 4x4 pixel packets.
+void render_tile_packets(Framebuffer::Tile &out) {
+	Vector loc = Camera::instance()->loc;
+	RayPacket packet;
+	Vector ray_pos[PACKET_SIZE], ray_dir[PACKET_SIZE], colors[PACKET_SIZE];
+	for (int y0 = out.y0; y0 < out.y1; y0 += PACKET_DIM) {
+		for (int x0 = out.x0; x0 < out.x1; x0 += PACKET_DIM) {
+			packet.clear();
+			for (int k = 0; k < PACKET_SIZE; k++) {
+				int x = x0 + k % PACKET_DIM, y = y0 + k / PACKET_DIM;
+				if (x >= out.x1 || y >= out.y1)
+					continue;
+				ray_dir[k] = camera_ray(pixel_i(x), pixel_j(y));
+				ray_pos[k] = loc + ray_dir[k] * RAY_EPS;
+				packet.set(k, ray_pos[k], ray_dir[k]);
+			}
+			packet.build_frustum(loc);
+			RenderStats::add(RenderStats::PACKETS);
+			RenderStats::add(RenderStats::PRIMARY_RAYS, __builtin_popcount(packet.active));
+			trace_packet(packet, ray_pos, ray_dir, colors);
+			for (int k = 0; k < PACKET_SIZE; k++) {
+				if ((packet.active >> k) & 1)
+					out.set(x0 + k % PACKET_DIM, y0 + k / PACKET_DIM, colors[k]);
+			}
+		}
+	}
+}
+
+// Renders the center sample of every pixel of a tile.
+void render_tile(Framebuffer::Tile &out) {
+	if (use_packets) {
+		render_tile_packets(out);
+		return;
+	}
+	for (int x = out.x0; x < out.x1; x++) {
+		for (int y = out.y0; y < out.y1; y++) {
+			out.set(x, y, render_pixel(pixel_i(x), pixel_j(y)));
+		}
+	}
+}
+
+// Tiles of TILE_SIZE covering `area`, in Morton order.
+vector<TileScheduler::Tile> area_tiles(const TileScheduler::Tile &area) {
+	auto tiles = TileScheduler::morton_tiles(area.x1 - area.x0, area.y1 - area.y0, TILE_SIZE);
+	for (auto &tile : tiles) {
+		tile.x0 += area.x0;
+		tile.x1 += area.x0;
+		tile.y0 += area.y0;
+		tile.y1 += area.y0;
+	}
+	return tiles;
+}
+
+/**
+ * Traces wf.rays, the primary rays of num_paths paths, through all their
+ * bounces and leaves the color of path p in colors[p]. Each stage is a
+ * parallel loop over a whole queue, and the stages of a bounce run in turn:
+ *   extend: closest hit of every ray;
+ *   shadow: one occlusion test per hit and non-ambient light;
+ *   shade:  light gathered at each hit, as in shade(), and its reflectance;
+ *   bounce: the reflections reflects() lets through become the next queue.
+ * Folding the bounces back together reproduces trace() exactly, including
+ * the clip at every bounce.
+ */
+void trace_wavefront(Wavefront &wf, int num_paths, Vector *colors) {
+	vector<int> shadow_lights;
+	for (int l = 0; l < (int)world_lights.size(); l++) {
+		if (!world_lights[l]->is_ambient)
+			shadow_lights.push_back(l);
+	}
+	int num_shadow = shadow_lights.size();
+	wf.levels.clear();
+	while (wf.rays.size() > 0) {
+		int n = wf.rays.size();
+		wf.hit.resize(n);
+		wf.t.resize(n);
+		wf.nx.resize(n);
+		wf.ny.resize(n);
+		wf.nz.resize(n);
+		TileScheduler::parallel_for(n, WAVEFRONT_GRAIN, num_threads, [&](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				double t = INF;
+				Vector normal;
+				wf.hit[i] = intersect_world(wf.rays.origin(i), wf.rays.dir(i), &t, &normal);
+				wf.t[i] = t;
+				wf.nx[i] = normal.x;
+				wf.ny[i] = normal.y;
+				wf.nz[i] = normal.z;
+			}
+		});
+		wf.live.clear();
+		for (int i = 0; i < n; i++) {
+			if (wf.hit[i] != nullptr)
+				wf.live.push_back(i);
+		}
+		int live = wf.live.size();
+
+		int shadow_rays = live * num_shadow;
+		wf.shadow.resize(shadow_rays);
+		wf.shadow_t_max.resize(shadow_rays);
+		wf.blocked.resize(shadow_rays);
+		TileScheduler::parallel_for(shadow_rays, WAVEFRONT_GRAIN, num_threads, [&](int begin, int end) {
+			for (int s = begin; s < end; s++) {
+				int i = wf.live[s / num_shadow];
+				Light *light = world_lights[shadow_lights[s % num_shadow]];
+				Vector hit_pos = wf.rays.origin(i) + (wf.rays.dir(i) * wf.t[i]);
+				Vector ray_to_light = light->direction(hit_pos);
+				wf.shadow.set(s, hit_pos + ray_to_light * RAY_EPS, ray_to_light, wf.rays.path[i]);
+				wf.shadow_t_max[s] = light->get_dist(hit_pos) + EPS;
+			}
+		});
+		TileScheduler::parallel_for(shadow_rays, WAVEFRONT_GRAIN, num_threads, [&](int begin, int end) {
+			for (int s = begin; s < end; s++)
+				wf.blocked[s] = occluded_world(wf.shadow.origin(s), wf.shadow.dir(s), wf.shadow_t_max[s]);
+			RenderStats::add(RenderStats::SHADOW_RAYS, end - begin);
+		});
+
+		wf.levels.emplace_back();
+		BounceLevel &level = wf.levels.back();
+		level.path.resize(live);
+		level.direct.resize(live);
+		level.reflectance.resize(live);
+		wf.next.resize(live);
+		wf.reflected.resize(live);
+		TileScheduler::parallel_for(live, WAVEFRONT_GRAIN, num_threads, [&](int begin, int end) {
+			int spawned = 0;
+			for (int j = begin; j < end; j++) {
+				int i = wf.live[j];
+				GeoObject *obj = wf.hit[i];
+				Vector ray_dir = wf.rays.dir(i), normal(wf.nx[i], wf.ny[i], wf.nz[i]);
+				Vector hit_pos = wf.rays.origin(i) + (ray_dir * wf.t[i]);
+				Vector color;
+				const char *blocked = &wf.blocked[(size_t)j * num_shadow];
+				for (auto &light_it : world_lights) {
+					if (!light_it->is_ambient && *blocked++)
+						continue;
+					color = color + obj->get_color(*light_it, -ray_dir, hit_pos, normal);
+				}
+				level.path[j] = wf.rays.path[i];
+				level.direct[j] = color;
+				level.reflectance[j] = Vector();
+				wf.reflected[j] = false;
+				int depth = wf.rays.depth[i];
+				if (depth > 1) {
+					Vector reflected = ray_dir - 2.0 * normal.dot(ray_dir) * normal;
+					reflected.normalize();
+					Vector throughput = wf.rays.throughput(i), weight;
+					int next_depth;
+					if (reflects(obj->material(), depth, throughput, color, hit_pos, reflected, &next_depth, &weight)) {
+						level.reflectance[j] = weight;
+						wf.next.set(j, hit_pos + reflected * RAY_EPS, reflected, wf.rays.path[i],
+						            next_depth, throughput * weight);
+						wf.reflected[j] = true;
+						spawned++;
+					}
+				}
+			}
+			RenderStats::add(RenderStats::REFLECTION_RAYS, spawned);
+		});
+		int next_rays = 0;
+		for (int j = 0; j < live; j++) {
+			if (wf.reflected[j])
+				wf.next.move(next_rays++, j);
+		}
+		wf.next.resize(next_rays);
+		swap(wf.rays, wf.next);
+	}
+
+	// A path's color after bounce k is its direct light there plus the
+	// weighted, already clipped color of bounce k + 1.
+	fill(colors, colors + num_paths, Vector());
+	for (int k = (int)wf.levels.size() - 1; k >= 0; k--) {
+		const BounceLevel &level = wf.levels[k];
+		TileScheduler::parallel_for(level.path.size(), WAVEFRONT_GRAIN, num_threads, [&](int begin, int end) {
+			for (int j = begin; j < end; j++) {
+				Vector &color = colors[level.path[j]];
+				color = (level.direct[j] + color * level.reflectance[j]).clip();
+			}
+		});
+	}
+}
+
+// Renders the center sample of every pixel of `area` in wavefronts of up
+// to WAVEFRONT_PATHS pixels, taken tile by tile in Morton order.
+void render_area_wavefront(Framebuffer *image, const TileScheduler::Tile &area) {
+	Vector loc = Camera::instance()->loc;
+	Wavefront wf;
+	vector<pair<int, int>> pixels;
+	vector<Vector> colors;
+	auto flush = [&]() {
+		int n = pixels.size();
+		wf.rays.resize(n);
+		TileScheduler::parallel_for(n, WAVEFRONT_GRAIN, num_threads, [&](int begin, int end) {
+			for (int p = begin; p < end; p++) {
+				Vector ray_dir = camera_ray(pixel_i(pixels[p].first), pixel_j(pixels[p].second));
+				wf.rays.set(p, loc + ray_dir * RAY_EPS, ray_dir, p, max_depth, Vector(1, 1, 1));
+			}
+			RenderStats::add(RenderStats::PRIMARY_RAYS, end - begin);
+		});
+		colors.resize(n);
+		trace_wavefront(wf, n, colors.data());
+		for (int p = 0; p < n; p++)
+			image->set(pixels[p].first, pixels[p].second, colors[p]);
+		pixels.clear();
+	};
+	for (auto &tile : area_tiles(area)) {
+		for (int y = tile.y0; y < tile.y1; y++) {
+			for (int x = tile.x0; x < tile.x1; x++)
+				pixels.push_back(make_pair(x, y));
+		}
+		if ((int)pixels.size() >= WAVEFRONT_PATHS)
+			flush();
+	}
+	if (!pixels.empty())
+		flush();
+}
+
+// Luminance of every pixel, read by the AA pass to find edges.
+vector<float> image_luminance(const Framebuffer &image) {
+	vector<float> lum((size_t)image.width * image.height);
+	for (int y = 0; y < image.height; y++) {
+		for (int x = 0; x < image.width; x++) {
+			const float *p = image.pixel(x, y);
+			lum[(size_t)y * image.width + x] = Sampler::luminance(Vector(p[0], p[1], p[2]));
 		}
 	}
+	return lum;
+}
+
+/**
+ * Adaptive anti-aliasing of a tile that holds one center sample per pixel.
+ * A pixel is refined when its luminance in base_lum differs from any of its
+ * eight neighbours' by more than aa_threshold, or when its first
+ * min_samples samples disagree; it then takes SAMPLE_BATCH samples at a
+ * time until the standard error of its mean luminance is below
+ * aa_threshold or it holds max_samples. Adds the extra samples to *spent.
+ */
+void refine_tile(Framebuffer::Tile &out, const vector<float> &base_lum, long *spent) {
+	int width = out.fb->width, height = out.fb->height;
+	for (int x = out.x0; x < out.x1; x++) {
+		for (int y = out.y0; y < out.y1; y++) {
+			float lum = base_lum[(size_t)y * width + x];
+			float contrast = 0.0f;
+			for (int ny = max(0, y - 1); ny <= min(height - 1, y + 1); ny++) {
+				for (int nx = max(0, x - 1); nx <= min(width - 1, x + 1); nx++)
+					contrast = max(contrast, fabs(base_lum[(size_t)ny * width + nx] - lum));
+			}
+
+			Sampler::PixelEstimate est;
+			const float *p = out.pixel(x, y);
+			est.add(Vector(p[0], p[1], p[2]));
+			while (est.count < min_samples)
+				est.add(render_sample(pixel_i(x), pixel_j(y), est.count));
+			bool refine = contrast > aa_threshold || est.std_error() > aa_threshold;
+			while (refine && est.count < max_samples) {
+				int batch = min(SAMPLE_BATCH, max_samples - est.count);
+				for (int k = 0; k < batch; k++)
+					est.add(render_sample(pixel_i(x), pixel_j(y), est.count));
+				refine = est.std_error() > aa_threshold;
+			}
+			*spent += est.count - 1;
+			out.set(x, y, est.mean());
+		}
+	}
+}
+
+// Renders the tile's pixels at level `stride` of the progressive schedule:
+// those on the stride grid that no coarser level covered. Each one also
+// fills its stride x stride block as a preview until finer levels arrive.
+void render_tile_level(Framebuffer::Tile &out, int stride) {
+	for (int y = out.y0; y < out.y1; y += stride) {
+		for (int x = out.x0; x < out.x1; x += stride) {
+			if (stride < PROGRESSIVE_STRIDE && x % (2 * stride) == 0 && y % (2 * stride) == 0)
+				continue;
+			Vector color = render_pixel(pixel_i(x), pixel_j(y));
+			for (int by = y; by < min(y + stride, out.y1); by++) {
+				for (int bx = x; bx < min(x + stride, out.x1); bx++)
+					out.set(bx, by, color);
+			}
+		}
+	}
+}
+
+volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int) {
+	stop_requested = 1;
+}
+
+/**
+ * Progressive render: one pass per level of the stride grid, coarse to
+ * fine, then the AA pass. Each pass runs its tiles in groups of a few per
+ * thread; between groups the state is checkpointed every
+ * checkpoint_interval seconds, and at once when SIGINT or SIGTERM asks the
+ * render to stop. Returns false if it stopped early.
+ */
+bool get_pixels_progressive(Framebuffer *image, const string &input_filename) {
+	Checkpoint current;
+	if (!current.stat_scene(input_filename)) {
+		cerr << "Cannot stat " << input_filename << endl;
+		return false;
+	}
+	Checkpoint state;
+	if (resume && state.load(checkpoint_filename)) {
+		if (state.image_width != image_width || state.image_height != image_height ||
+		    state.crop_x0 != crop_x0 || state.crop_y0 != crop_y0 ||
+		    state.image.width != crop_x1 - crop_x0 || state.image.height != crop_y1 - crop_y0 ||
+		    state.min_samples != min_samples || state.max_samples != max_samples ||
+		    state.aa_threshold != aa_threshold || state.max_depth != max_depth ||
+		    state.min_throughput != min_throughput || state.use_roulette != use_roulette ||
+		    state.scene != current.scene || state.scene_size != current.scene_size ||
+		    state.scene_mtime != current.scene_mtime) {
+			cerr << "Checkpoint " << checkpoint_filename << " was made with other settings; starting over." << endl;
+			state = Checkpoint();
+		} else {
+			cerr << "Resuming from " << checkpoint_filename << " at pass " << state.pass
+			     << ", tile " << state.next_tile << "." << endl;
+		}
+	} else if (resume) {
+		cerr << "No usable checkpoint at " << checkpoint_filename << "; starting over." << endl;
+	}
+	if (state.image.width == 0) {
+		state.image.resize(crop_x1 - crop_x0, crop_y1 - crop_y0);
+		state.image_width = image_width;
+		state.image_height = image_height;
+		state.crop_x0 = crop_x0;
+		state.crop_y0 = crop_y0;
+		state.min_samples = min_samples;
+		state.max_samples = max_samples;
+		state.aa_threshold = aa_threshold;
+		state.max_depth = max_depth;
+		state.min_throughput = min_throughput;
+		state.use_roulette = use_roulette;
+		state.stat_scene(input_filename);
+	}
+
+	signal(SIGINT, request_stop);
+	signal(SIGTERM, request_stop);
+	auto tiles = TileScheduler::morton_tiles(state.image.width, state.image.height, TILE_SIZE);
+	int num_tiles = tiles.size();
+	int group_size = max(64, 8 * num_threads);
+	int num_levels = 0;
+	for (int stride = PROGRESSIVE_STRIDE; stride >= 1; stride /= 2)
+		num_levels++;
+	int num_passes = num_levels + (max_samples > 1 ? 1 : 0);
+	if (state.pass == 0 && state.next_tile == 0)
+		state.samples_spent = (long)state.image.width * state.image.height;
+
+	auto last_save = chrono::steady_clock::now();
+	for (; state.pass < num_passes; state.pass++, state.next_tile = 0) {
+		bool aa_pass = state.pass == num_levels;
+		if (aa_pass && state.base_lum.empty())
+			state.base_lum = image_luminance(state.image);
+		int stride = PROGRESSIVE_STRIDE >> state.pass;
+		while (state.next_tile < num_tiles) {
+			int end = min(num_tiles, state.next_tile + group_size);
+			vector<TileScheduler::Tile> group(tiles.begin() + state.next_tile, tiles.begin() + end);
+			vector<long> spent(num_threads, 0);
+			TileScheduler::run(group, num_threads, [&](const TileScheduler::Tile &tile, int worker) {
+				Framebuffer::Tile out = state.image.tile(tile.x0, tile.y0, tile.x1, tile.y1);
+				if (aa_pass)
+					refine_tile(out, state.base_lum, &spent[worker]);
+				else
+					render_tile_level(out, stride);
+			});
+			for (long n : spent)
+				state.samples_spent += n;
+			state.next_tile = end;
+
+			auto now = chrono::steady_clock::now();
+			if (stop_requested || chrono::duration<double>(now - last_save).count() >= checkpoint_interval) {
+				if (!state.save(checkpoint_filename))
+					cerr << "Cannot write checkpoint " << checkpoint_filename << endl;
+				last_save = now;
+				if (stop_requested) {
+					cerr << "Stopped at pass " << state.pass << ", tile " << state.next_tile
+					     << "; continue with --resume." << endl;
+					return false;
+				}
+			}
+		}
+	}
+	samples_spent = state.samples_spent;
+	*image = move(state.image);
+	return true;
+}
+
+void get_pixels(Framebuffer *image) {
+	// Every pixel is traced independently, so the tiles can be rendered in
+	// any order and on any thread without changing the result.
+	image->resize(crop_x1 - crop_x0, crop_y1 - crop_y0);
+	auto tiles = TileScheduler::morton_tiles(image->width, image->height, TILE_SIZE);
+	if (use_wavefront) {
+		render_area_wavefront(image, TileScheduler::Tile{0, 0, image->width, image->height});
+	} else {
+		TileScheduler::run(tiles, num_threads, [&](const TileScheduler::Tile &tile, int /*worker*/) {
+			Framebuffer::Tile out = image->tile(tile.x0, tile.y0, tile.x1, tile.y1);
+			render_tile(out);
+		});
+	}
+	samples_spent = (long)image->width * image->height;
+	if (max_samples <= 1)
+		return;
+	vector<float> base_lum = image_luminance(*image);
+	vector<long> spent(num_threads, 0);
+	TileScheduler::run(tiles, num_threads, [&](const TileScheduler::Tile &tile, int worker) {
+		Framebuffer::Tile out = image->tile(tile.x0, tile.y0, tile.x1, tile.y1);
+		refine_tile(out, base_lum, &spent[worker]);
+	});
+	for (long n : spent)
+		samples_spent += n;
+}
+
+/**
+ * Distributed rendering. The coordinator splits the crop window into
+ * JOB_SIZE squares and hands them to worker processes, each a copy of this
+ * program started with --worker on the same scene and settings. A request
+ * is a JobRequest; the worker answers with a JobReply followed by the
+ * job's pixels, row by row from the bottom. Both sides use the window's
+ * framebuffer coordinates.
+ */
+struct JobRequest {
+	int32_t x0, y0, x1, y1;
+};
+
+struct JobReply {
+	static const uint32_t MAGIC = 0x424f4a52; // "RJOB"
+	uint32_t magic;
+	int32_t x0, y0, x1, y1;
+	int64_t samples;
+	uint64_t counters[RenderStats::NUM_COUNTERS];
+};
+
+/**
+ * Renders one job into the worker's copy of the window. The AA pass looks
+ * at the neighbours of each pixel, so the center samples are traced one
+ * pixel beyond the job where the window allows; the job's pixels then come
+ * out exactly as in a local render. Returns the samples taken inside it.
+ */
+long render_job(Framebuffer *image, vector<float> *base_lum, const TileScheduler::Tile &job) {
+	TileScheduler::Tile area = job;
+	if (max_samples > 1) {
+		area.x0 = max(0, job.x0 - 1);
+		area.y0 = max(0, job.y0 - 1);
+		area.x1 = min(image->width, job.x1 + 1);
+		area.y1 = min(image->height, job.y1 + 1);
+	}
+	if (use_wavefront) {
+		render_area_wavefront(image, area);
+	} else {
+		TileScheduler::run(area_tiles(area), num_threads, [&](const TileScheduler::Tile &tile, int /*worker*/) {
+			Framebuffer::Tile out = image->tile(tile.x0, tile.y0, tile.x1, tile.y1);
+			render_tile(out);
+		});
+	}
+	long samples = (long)(job.x1 - job.x0) * (job.y1 - job.y0);
+	if (max_samples <= 1)
+		return samples;
+	for (int y = area.y0; y < area.y1; y++) {
+		for (int x = area.x0; x < area.x1; x++) {
+			const float *p = image->pixel(x, y);
+			(*base_lum)[(size_t)y * image->width + x] = Sampler::luminance(Vector(p[0], p[1], p[2]));
+		}
+	}
+	vector<long> spent(num_threads, 0);
+	TileScheduler::run(area_tiles(job), num_threads, [&](const TileScheduler::Tile &tile, int worker) {
+		Framebuffer::Tile out = image->tile(tile.x0, tile.y0, tile.x1, tile.y1);
+		refine_tile(out, *base_lum, &spent[worker]);
+	});
+	for (long n : spent)
+		samples += n;
+	return samples;
+}
+
+/**
+ * Worker side: answers job requests on stdin until it is closed. Replies
+ * carry the job's samples and the counters it added, so the coordinator's
+ * --stats covers the whole render. Stdout is kept for replies only;
+ * anything else printed goes to stderr.
+ */
+int run_worker() {
+	int reply_fd = dup(STDOUT_FILENO);
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+	Framebuffer image(crop_x1 - crop_x0, crop_y1 - crop_y0);
+	vector<float> base_lum(max_samples > 1 ? (size_t)image.width * image.height : 0);
+	RenderStats::Block reported;
+	JobRequest request;
+	while (WorkerProcess::read_fully(STDIN_FILENO, &request, sizeof(request))) {
+		TileScheduler::Tile job = {request.x0, request.y0, request.x1, request.y1};
+		if (job.x0 < 0 || job.y0 < 0 || job.x1 > image.width || job.y1 > image.height ||
+		    job.x0 >= job.x1 || job.y0 >= job.y1) {
+			cerr << "Worker got a job outside the window: " << job.x0 << "," << job.y0 << ","
+			     << job.x1 << "," << job.y1 << endl;
+			return 1;
+		}
+		JobReply reply;
+		reply.magic = JobReply::MAGIC;
+		reply.x0 = job.x0;
+		reply.y0 = job.y0;
+		reply.x1 = job.x1;
+		reply.y1 = job.y1;
+		reply.samples = render_job(&image, &base_lum, job);
+		RenderStats::Block total = RenderStats::merged();
+		for (int i = 0; i < RenderStats::NUM_COUNTERS; i++)
+			reply.counters[i] = total.count[i] - reported.count[i];
+		reported = total;
+
+		size_t row = (size_t)(job.x1 - job.x0) * 3;
+		vector<float> pixels(row * (job.y1 - job.y0));
+		for (int y = job.y0; y < job.y1; y++)
+			copy(image.pixel(job.x0, y), image.pixel(job.x0, y) + row, &pixels[row * (y - job.y0)]);
+		if (!WorkerProcess::write_fully(reply_fd, &reply, sizeof(reply)) ||
+		    !WorkerProcess::write_fully(reply_fd, pixels.data(), pixels.size() * sizeof(float)))
+			return 1;
+	}
+	return 0;
+}
+
+string shell_quote(const string &arg) {
+	string quoted = "'";
+	for (char c : arg)
+		quoted += c == '\'' ? string("'\\''") : string(1, c);
+	return quoted + "'";
+}
+
+// Arguments that make a worker render the same window the same way.
+vector<string> worker_args(const string &input_filename) {
+	ostringstream threshold, crop;
+	threshold.precision(17);
+	threshold << aa_threshold;
+	crop << crop_x0 << "," << crop_y0 << "," << crop_x1 << "," << crop_y1;
+	vector<string> args = {input_filename, "--worker",
+	                       "--width", to_string(image_width), "--height", to_string(image_height),
+	                       "--depth", to_string(max_depth), "--crop", crop.str(),
+	                       "--min-samples", to_string(min_samples), "--max-samples", to_string(max_samples),
+	                       "--aa-threshold", threshold.str()};
+	if (use_packets)
+		args.push_back("--packets");
+	if (use_wavefront)
+		args.push_back("--wavefront");
+	if (min_throughput > 0.0) {
+		ostringstream cutoff;
+		cutoff.precision(17);
+		cutoff << min_throughput;
+		args.push_back("--min-throughput");
+		args.push_back(cutoff.str());
+	}
+	if (use_roulette)
+		args.push_back("--roulette");
+	if (out_of_core_mb > 0) {
+		args.push_back("--out-of-core");
+		args.push_back(to_string(out_of_core_mb));
+	}
+	return args;
+}
+
+struct WorkerSlot {
+	WorkerProcess process;
+	string name;
+	string command;       // shell command for a remote worker; empty for a local one
+	deque<int> jobs;      // requests sent and not yet answered, oldest first
+	chrono::steady_clock::time_point front_since;
+};
+
+/**
+ * Coordinator side. Every worker holds up to JOB_DEPTH requests; replies
+ * are collected with poll() as they arrive. When a worker dies, sends a
+ * malformed reply or sits on a job longer than tile_timeout seconds, it is
+ * killed and restarted and its unanswered jobs go back to the front of the
+ * queue. A job that fails more than tile_retries times ends the render.
+ */
+bool get_pixels_distributed(Framebuffer *image, const string &input_filename) {
+	image->resize(crop_x1 - crop_x0, crop_y1 - crop_y0);
+	auto jobs = TileScheduler::morton_tiles(image->width, image->height, JOB_SIZE);
+	deque<int> pending;
+	for (int j = 0; j < (int)jobs.size(); j++)
+		pending.push_back(j);
+	vector<int> attempts(jobs.size(), 0);
+	int finished = 0;
+	samples_spent = 0;
+
+	vector<string> local_args = worker_args(input_filename);
+	local_args.insert(local_args.begin(), "/proc/self/exe");
+	local_args.push_back("--threads");
+	local_args.push_back(to_string(max(1, num_threads / max(1, num_workers))));
+	if (use_packets) {
+		local_args.push_back("--packet-isa");
+		local_args.push_back(packet_kernels().isa);
+	}
+	string remote_args;
+	for (auto &arg : worker_args(input_filename))
+		remote_args += " " + shell_quote(arg);
+	vector<WorkerSlot> slots(num_workers + worker_commands.size());
+	for (size_t w = 0; w < slots.size(); w++) {
+		if ((int)w < num_workers) {
+			slots[w].name = "local worker " + to_string(w + 1);
+		} else {
+			slots[w].name = "\"" + worker_commands[w - num_workers] + "\"";
+			slots[w].command = worker_commands[w - num_workers] + remote_args;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	bool ok = true;
+	auto fail = [&](WorkerSlot &slot, const string &why) {
+		cerr << "Worker " << slot.name << " " << why
+		     << "; retrying its " << slot.jobs.size() << " job(s)." << endl;
+		slot.process.kill_now();
+		while (!slot.jobs.empty()) {
+			int j = slot.jobs.back();
+			slot.jobs.pop_back();
+			if (++attempts[j] > tile_retries) {
+				cerr << "Job " << jobs[j].x0 << "," << jobs[j].y0 << "," << jobs[j].x1 << "," << jobs[j].y1
+				     << " failed " << attempts[j] << " times; giving up." << endl;
+				ok = false;
+			}
+			pending.push_front(j);
+		}
+	};
+
+	while (ok && finished < (int)jobs.size()) {
+		auto now = chrono::steady_clock::now();
+		for (auto &slot : slots) {
+			if (!slot.process.running() && !pending.empty()) {
+				bool started = slot.command.empty() ? slot.process.start(local_args)
+				                                    : slot.process.start_shell(slot.command);
+				if (!started) {
+					cerr << "Cannot start worker: " << strerror(errno) << endl;
+					return false;
+				}
+			}
+			while (slot.process.running() && (int)slot.jobs.size() < JOB_DEPTH && !pending.empty()) {
+				int j = pending.front();
+				JobRequest request = {jobs[j].x0, jobs[j].y0, jobs[j].x1, jobs[j].y1};
+				if (slot.jobs.empty())
+					slot.front_since = now;
+				slot.jobs.push_back(j);
+				pending.pop_front();
+				if (!slot.process.write_all(&request, sizeof(request))) {
+					fail(slot, "stopped taking jobs");
+					break;
+				}
+			}
+		}
+		if (!ok)
+			break;
+
+		vector<pollfd> fds;
+		vector<WorkerSlot *> polled;
+		for (auto &slot : slots) {
+			if (slot.process.running() && !slot.jobs.empty()) {
+				fds.push_back({slot.process.from_child, POLLIN, 0});
+				polled.push_back(&slot);
+			}
+		}
+		if (poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR) {
+			cerr << "poll failed: " << strerror(errno) << endl;
+			return false;
+		}
+		now = chrono::steady_clock::now();
+		for (size_t k = 0; k < fds.size() && ok; k++) {
+			WorkerSlot &slot = *polled[k];
+			if (fds[k].revents == 0) {
+				if (tile_timeout > 0.0 && chrono::duration<double>(now - slot.front_since).count() > tile_timeout)
+					fail(slot, "timed out");
+				continue;
+			}
+			const TileScheduler::Tile &job = jobs[slot.jobs.front()];
+			JobReply reply;
+			if (!slot.process.read_all(&reply, sizeof(reply)) || reply.magic != JobReply::MAGIC ||
+			    reply.x0 != job.x0 || reply.y0 != job.y0 || reply.x1 != job.x1 || reply.y1 != job.y1) {
+				fail(slot, "sent no valid reply");
+				continue;
+			}
+			size_t row = (size_t)(job.x1 - job.x0) * 3;
+			vector<float> pixels(row * (job.y1 - job.y0));
+			if (!slot.process.read_all(pixels.data(), pixels.size() * sizeof(float))) {
+				fail(slot, "sent a short reply");
+				continue;
+			}
+			for (int y = job.y0; y < job.y1; y++)
+				copy(&pixels[row * (y - job.y0)], &pixels[row * (y - job.y0 + 1)], image->pixel(job.x0, y));
+			for (int i = 0; i < RenderStats::NUM_COUNTERS; i++)
+				RenderStats::add((RenderStats::Counter)i, reply.counters[i]);
+			samples_spent += reply.samples;
+			finished++;
+			slot.jobs.pop_front();
+			slot.front_since = now;
+		}
+	}
+	for (auto &slot : slots) {
+		if (slot.process.running())
+			slot.process.finish();
+	}
+	return ok;
 }
 
 void LOG(const string &msg) {
 	cerr << msg << endl;
 }
 
+/**
+ * Renders and writes every frame. Frame 0 is already set up and the BVH
+ * built for it; each later frame only moves the camera and the keyframed
+ * objects and refits the BVH, so nothing is parsed, loaded or rebuilt.
+ */
+void render_animation(const string &output_filename) {
+	Framebuffer image;
+	long total_samples = 0;
+	for (int frame = 0; frame < num_frames; frame++) {
+		auto start = chrono::steady_clock::now();
+		if (frame > 0) {
+			set_frame(frame);
+			refit_bvh();
+		}
+		auto moved = chrono::steady_clock::now();
+		get_pixels(&image);
+		total_samples += samples_spent;
+		string filename = frame_filename(output_filename, frame);
+		write_file(filename, image);
+		auto done = chrono::steady_clock::now();
+		ostringstream msg;
+		msg << "Frame " << frame << " -> " << filename << ": setup "
+		    << chrono::duration<double, milli>(moved - start).count() << " ms, render "
+		    << chrono::duration<double>(done - moved).count() << " s";
+		LOG(msg.str());
+	}
+	samples_spent = total_samples;
+}
+
+// Out-of-core mode: how well the chunk budget held the working set.
+void log_chunk_cache() {
+	RenderStats::Block stats = RenderStats::merged();
+	uint64_t hits = stats.count[RenderStats::CHUNK_HITS], misses = stats.count[RenderStats::CHUNK_MISSES];
+	ChunkCache &cache = ChunkCache::instance();
+	ostringstream msg;
+	msg << "Mesh chunks: " << hits << " hits, " << misses << " misses ("
+	    << 100.0 * hits / max<uint64_t>(1, hits + misses) << "% hit rate), "
+	    << stats.count[RenderStats::CHUNK_EVICTIONS] << " evictions, peak "
+	    << cache.peak_bytes / (1024.0 * 1024.0) << " MB mapped of " << out_of_core_mb << " MB.";
+	LOG(msg.str());
+}
+
+// Wall-clock time of each phase of main(), recorded in order.
+class PhaseTimer {
+ public:
+	PhaseTimer() : start(chrono::steady_clock::now()), last(start) {}
+	// Records the time since the previous lap as phase `name`.
+	void lap(const string &name) {
+		auto now = chrono::steady_clock::now();
+		phases.push_back(make_pair(name, chrono::duration<double>(now - last).count()));
+		last = now;
+	}
+	double seconds(const string &name) const {
+		for (auto &it : phases) {
+			if (it.first == name)
+				return it.second;
+		}
+		return 0.0;
+	}
+	double total() const {
+		return chrono::duration<double>(last - start).count();
+	}
+	vector<pair<string, double>> phases;
+
+ private:
+	chrono::steady_clock::time_point start, last;
+};
+
+// Text as a quoted JSON string, with quotes, backslashes and control
+// characters escaped.
+string json_string(const string &text) {
+	string out = "\"";
+	for (unsigned char ch : text) {
+		if (ch == '"' || ch == '\\') {
+			out += '\\';
+			out += ch;
+		} else if (ch < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", ch);
+			out += buf;
+		} else {
+			out += ch;
+		}
+	}
+	return out + "\"";
+}
+
+/**
+ * Writes the merged render counters and phase timings as JSON to filename,
+ * or to stdout for "-". Rays per second are measured over the render phase
+ * only; tests per ray count BVH box tests and primitive tests separately.
+ */
+void write_stats(const string &filename, const string &input_filename, const PhaseTimer &timer) {
+	RenderStats::Block stats = RenderStats::merged();
+	const uint64_t *c = stats.count;
+	uint64_t rays = c[RenderStats::PRIMARY_RAYS] + c[RenderStats::SHADOW_RAYS] + c[RenderStats::REFLECTION_RAYS];
+	uint64_t prim_tests = c[RenderStats::SPHERE_TESTS] + c[RenderStats::ELLIPSOID_TESTS] +
+	                      c[RenderStats::TRIANGLE_TESTS] + c[RenderStats::MESH_FACE_TESTS];
+	double render_seconds = timer.seconds("render");
+	double per_ray = rays > 0 ? 1.0 / rays : 0.0;
+
+	ofstream file;
+	if (filename != "-") {
+		file.open(filename);
+		if (!file) {
+			cerr << "Cannot write stats file: " << filename << endl;
+			return;
+		}
+	}
+	ostream &out = filename == "-" ? cout : file;
+	out << "{\n";
+	out << "  \"scene\": " << json_string(input_filename) << ",\n";
+	out << "  \"width\": " << crop_x1 - crop_x0 << ",\n";
+	out << "  \"height\": " << crop_y1 - crop_y0 << ",\n";
+	out << "  \"threads\": " << num_threads << ",\n";
+	out << "  \"objects\": " << world_objects.size() << ",\n";
+	out << "  \"samples\": " << samples_spent << ",\n";
+	out << "  \"phases\": {";
+	for (auto &it : timer.phases)
+		out << "\"" << it.first << "\": " << it.second << ", ";
+	out << "\"total\": " << timer.total() << "},\n";
+	out << "  \"counters\": {";
+	for (int i = 0; i < RenderStats::NUM_COUNTERS; i++)
+		out << (i ? ", " : "") << "\"" << RenderStats::name(i) << "\": " << c[i];
+	out << "},\n";
+	out << "  \"rays\": " << rays << ",\n";
+	out << "  \"rays_per_second\": " << (render_seconds > 0.0 ? rays / render_seconds : 0.0) << ",\n";
+	out << "  \"bvh_node_tests_per_ray\": " << c[RenderStats::BVH_NODE_TESTS] * per_ray << ",\n";
+	out << "  \"primitive_tests_per_ray\": " << prim_tests * per_ray << "\n";
+	out << "}" << endl;
+}
+
 int main(int argc, char *argv[]) {
 	string input_filename = "raytracer.in";
 	string output_filename = "raytracer.png";
-	if (argc >= 2)
-		input_filename = string(argv[1]);
-	if (argc >= 3)
-		output_filename = string(argv[2]);
+	string stats_filename;
+	string compile_filename;
+	bool worker_mode = false;
+	int cli_frames = 0;
+	int positional = 0;
+	int cli_width = 0, cli_height = 0, cli_depth = 0;
+	int cli_crop[4];
+	bool has_cli_crop = false;
+	for (int i = 1; i < argc; i++) {
+		string arg(argv[i]);
+		if (arg == "--threads" && i + 1 < argc) {
+			num_threads = max(1, atoi(argv[++i]));
+		} else if (arg == "--packets") {
+			use_packets = true;
+		} else if (arg == "--compile" && i + 1 < argc) {
+			compile_filename = argv[++i];
+		} else if (arg == "--wavefront") {
+			use_wavefront = true;
+		} else if (arg == "--min-throughput" && i + 1 < argc) {
+			min_throughput = max(0.0, atof(argv[++i]));
+		} else if (arg == "--roulette") {
+			use_roulette = true;
+		} else if (arg == "--packet-isa" && i + 1 < argc) {
+			use_packets = true;
+			if (!select_packet_isa(argv[++i])) {
+				cerr << "Packet instruction set not available: " << argv[i] << endl;
+				return 1;
+			}
+		} else if (arg == "--min-samples" && i + 1 < argc) {
+			min_samples = max(1, atoi(argv[++i]));
+		} else if (arg == "--max-samples" && i + 1 < argc) {
+			max_samples = max(1, atoi(argv[++i]));
+		} else if (arg == "--aa-threshold" && i + 1 < argc) {
+			aa_threshold = atof(argv[++i]);
+		} else if (arg == "--progressive") {
+			progressive = true;
+		} else if (arg == "--resume") {
+			progressive = resume = true;
+		} else if (arg == "--checkpoint" && i + 1 < argc) {
+			progressive = true;
+			checkpoint_filename = argv[++i];
+		} else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+			checkpoint_interval = atof(argv[++i]);
+		} else if (arg == "--stats" && i + 1 < argc) {
+			stats_filename = argv[++i];
+		} else if (arg == "--width" && i + 1 < argc) {
+			cli_width = max(1, atoi(argv[++i]));
+		} else if (arg == "--height" && i + 1 < argc) {
+			cli_height = max(1, atoi(argv[++i]));
+		} else if (arg == "--depth" && i + 1 < argc) {
+			cli_depth = max(1, atoi(argv[++i]));
+		} else if (arg == "--crop" && i + 1 < argc) {
+			has_cli_crop = sscanf(argv[++i], "%d,%d,%d,%d", &cli_crop[0], &cli_crop[1], &cli_crop[2], &cli_crop[3]) == 4;
+			if (!has_cli_crop) {
+				cerr << "Expected --crop x0,y0,x1,y1 but got " << argv[i] << endl;
+				return 1;
+			}
+		} else if (arg == "--workers" && i + 1 < argc) {
+			num_workers = max(0, atoi(argv[++i]));
+		} else if (arg == "--worker-command" && i + 1 < argc) {
+			worker_commands.push_back(argv[++i]);
+		} else if (arg == "--tile-retries" && i + 1 < argc) {
+			tile_retries = max(0, atoi(argv[++i]));
+		} else if (arg == "--tile-timeout" && i + 1 < argc) {
+			tile_timeout = atof(argv[++i]);
+		} else if (arg == "--worker") {
+			worker_mode = true;
+		} else if (arg == "--frames" && i + 1 < argc) {
+			cli_frames = max(1, atoi(argv[++i]));
+		} else if (arg == "--out-of-core" && i + 1 < argc) {
+			out_of_core_mb = max(1, atoi(argv[++i]));
+			ChunkCache::instance().budget = (size_t)out_of_core_mb << 20;
+		} else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+			cerr << "Unknown option: " << arg << endl;
+			return 1;
+		} else if (positional == 0) {
+			input_filename = arg;
+			positional++;
+		} else if (positional == 1) {
+			output_filename = arg;
+			positional++;
+		}
+	}
 
-	map<pii, Vector> image;
-	parse_input(input_filename);
+	Framebuffer image;
+	PhaseTimer timer;
+	bool compiled = SceneCache::is_compiled(input_filename);
+	if (compiled) {
+		if (!load_compiled(input_filename))
+			return 1;
+	} else {
+		parse_input(input_filename);
+	}
+	timer.lap("parse");
 	LOG("Done parsing input.");
-	get_pixels(&image);
+	if (cli_width > 0)
+		image_width = cli_width;
+	if (cli_height > 0)
+		image_height = cli_height;
+	if (cli_depth > 0)
+		max_depth = cli_depth;
+	if (cli_frames > 0)
+		num_frames = cli_frames;
+	if (has_cli_crop) {
+		crop_x0 = cli_crop[0];
+		crop_y0 = cli_crop[1];
+		crop_x1 = cli_crop[2];
+		crop_y1 = cli_crop[3];
+		has_crop = true;
+	}
+	if (!has_crop) {
+		crop_x0 = crop_y0 = 0;
+		crop_x1 = image_width;
+		crop_y1 = image_height;
+	}
+	if (crop_x0 < 0 || crop_y0 < 0 || crop_x1 > image_width || crop_y1 > image_height ||
+	    crop_x0 >= crop_x1 || crop_y0 >= crop_y1) {
+		cerr << "Crop window " << crop_x0 << "," << crop_y0 << "," << crop_x1 << "," << crop_y1
+		     << " does not fit a " << image_width << "x" << image_height << " image." << endl;
+		return 1;
+	}
+	if (!compile_filename.empty()) {
+		if (!compiled)
+			build_bvh();
+		if (!compile_scene(compile_filename))
+			return 1;
+		LOG("Compiled scene to " + compile_filename + ".");
+		return 0;
+	}
+	bool distributed = num_workers > 0 || !worker_commands.empty();
+	if (use_wavefront && (use_packets || progressive)) {
+		cerr << "--wavefront cannot be combined with --packets or --progressive." << endl;
+		return 1;
+	}
+	if (distributed && (progressive || worker_mode)) {
+		cerr << "--workers and --worker-command cannot be combined with --progressive or --worker." << endl;
+		return 1;
+	}
+	bool animated = num_frames > 1;
+	if (animated && (distributed || progressive || worker_mode)) {
+		cerr << "Animations cannot be rendered with --progressive or by workers." << endl;
+		return 1;
+	}
+	max_samples = max(max_samples, min_samples);
+	if (use_roulette && min_throughput == 0.0)
+		min_throughput = 0.1;
+	if (animated) {
+		setup_animation();
+		set_frame(0);
+	}
+	if (!distributed && !compiled) {
+		build_bvh();
+		timer.lap("build");
+		LOG("Done building BVH.");
+	}
+	if (!distributed)
+		primitives.partition(world_objects, world_bvh);
+	if (worker_mode)
+		return run_worker();
+	if (use_packets)
+		LOG(string("Tracing primary rays in ") + packet_kernels().isa + " packets.");
+	if (checkpoint_filename.empty())
+		checkpoint_filename = output_filename + ".ckpt";
+	if (animated) {
+		render_animation(output_filename);
+		timer.lap("render");
+		LOG("Done rendering " + to_string(num_frames) + " frames.");
+		if (out_of_core_mb > 0)
+			log_chunk_cache();
+		if (!stats_filename.empty())
+			write_stats(stats_filename, input_filename, timer);
+		free_objects();
+		return 0;
+	}
+	if (distributed) {
+		if (!get_pixels_distributed(&image, input_filename))
+			return 2;
+	} else if (progressive) {
+		if (!get_pixels_progressive(&image, input_filename))
+			return 2;
+	} else {
+		get_pixels(&image);
+	}
+	timer.lap("render");
 	LOG("Done generating image.");
+	if (out_of_core_mb > 0 && !distributed)
+		log_chunk_cache();
+	if (max_samples > 1) {
+		long pixels = (long)image.width * image.height;
+		ostringstream msg;
+		msg << "Spent " << samples_spent << " samples, " << (double)samples_spent / pixels
+		    << " per pixel (" << 100.0 * samples_spent / (pixels * max_samples)
+		    << "% of uniform " << max_samples << "x supersampling).";
+		LOG(msg.str());
+	}
 	write_file(output_filename, image);
+	timer.lap("write");
 	LOG("Written image to file.");
+	if (!stats_filename.empty())
+		write_stats(stats_filename, input_filename, timer);
+	if (progressive)
+		remove(checkpoint_filename.c_str());
 
-	for (int i = 0; i < (int)world_objects.size(); i++) {
-		delete world_objects[i];
-		world_objects[i] = nullptr;
-	}
+	free_objects();
 	return 0;
 }
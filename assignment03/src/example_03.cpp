@@ -4,12 +4,15 @@
 #include <cmath>
 #include <cstring>
 #include <memory>
-#include <sstream>
+#include <string_view>
 #include <thread>
 #include <chrono>
 
 #include "BezierObject.h"
+#include "MappedFile.h"
+#include "ObjLoader.h"
 #include "Polygon.h"
+#include "TextScanner.h"
 
 //include header file for glfw library so that we can use OpenGL
 #include <GLFW/glfw3.h>
@@ -294,36 +297,33 @@ void apply_global_transformation(const transform_t &trans_type, const Vector3f &
 }
 
 void parse_scene_file(const string &input_filename) {
-  ifstream fin(input_filename);
-  string line, type;
+  MappedFile file(input_filename);
+  TextScanner text(file.begin(), file.end()), line;
+  string_view type;
   Transform<T, 3, Affine> transformation = Transform<T, 3, Affine>::Identity();
 
-  while (getline(fin, line)) {
-    stringstream ss;
-    ss << line;
-    ss >> type;
+  while (text.next_line(&line)) {
+    if (!line.word(&type))
+      continue;
 
-    string spec_filename;
+    string_view spec_filename;
     if (type == "obj") {
-      ss >> spec_filename;
-      parse_obj_file(spec_filename, transformation);
+      if (line.word(&spec_filename))
+        parse_obj_file(string(spec_filename), transformation);
     } else if (type == "bez") {
-      ss >> spec_filename;
-      parse_bez_file(spec_filename, transformation);
+      if (line.word(&spec_filename))
+        parse_bez_file(string(spec_filename), transformation);
     } else if ((int)type.length() == 3 && type[0] == 'x' && type[1] == 'f') {
       // transformation
-      if (type[2] == 't') {
-        T x, y, z;
-        ss >> x >> y >> z;
+      T x, y, z;
+      bool has_xyz = line.number(&x) && line.number(&y) && line.number(&z);
+      if (type[2] == 't' && has_xyz) {
         transformation = Translation<T, 3>(x, y, z) * transformation;
-      } else if (type[2] == 'r') {
-        T x, y, z, rad;
-        ss >> x >> y >> z >> rad;
-
-        transformation = AngleAxis<T>(rad, Vector3f(x, y, z).normalized());
-      } else if (type[2] == 's') {
-        T x, y, z;
-        ss >> x >> y >> z;
+      } else if (type[2] == 'r' && has_xyz) {
+        T rad;
+        if (line.number(&rad))
+          transformation = AngleAxis<T>(rad, Vector3f(x, y, z).normalized());
+      } else if (type[2] == 's' && has_xyz) {
         transformation = Scaling(x, y, z) * transformation;
       } else if (type[2] == 'z') {
         transformation = Transform<T, 3, Affine>::Identity();
@@ -335,29 +335,25 @@ void parse_scene_file(const string &input_filename) {
 void parse_obj_file(const string &input_filename,
                     const Transform<T, 3, Affine> &transformation) {
   T max_coord = -1e-10;
-  ifstream fin(input_filename);
-  string line;
-  char type;
+  ObjData obj;
+  if (!load_obj(input_filename, &obj)) {
+    cerr << "Cannot open .obj file: " << input_filename << endl;
+    return;
+  }
+  cerr << "Loaded " << input_filename << ": " << obj.bytes / (1024.0 * 1024.0) << " MB in "
+       << obj.seconds << " s (" << obj.mb_per_sec() << " MB/s)" << endl;
   unique_ptr<Polygon> polygon(new Polygon(++obj_iter));
 
-  while (getline(fin, line)) {
-    stringstream ss;
-    ss << line;
-    ss >> type;
-
-    if (type == 'v') {
-      T x, y, z;
-      ss >> x >> y >> z;
-      max_coord = max(max_coord, max(fabs(x), max(fabs(y), fabs(z))));
-      polygon->vertices.push_back(move(unique_ptr<Vector3f>(new Vector3f(x, y, z))));
-    } else {
-      vector<int> faces;
-      int x;
-      while (ss >> x) {
-        faces.push_back(x-1);
-      }
-      polygon->faces.push_back(move(faces));
-    }
+  polygon->vertices.reserve(obj.num_vertices());
+  for (int i = 0; i < obj.num_vertices(); i++) {
+    T x = obj.vertices[3 * i], y = obj.vertices[3 * i + 1], z = obj.vertices[3 * i + 2];
+    max_coord = max(max_coord, max(fabs(x), max(fabs(y), fabs(z))));
+    polygon->vertices.push_back(move(unique_ptr<Vector3f>(new Vector3f(x, y, z))));
+  }
+  polygon->faces.reserve(obj.num_faces());
+  for (int f = 0; f < obj.num_faces(); f++) {
+    polygon->faces.push_back(vector<int>(obj.indices.begin() + obj.face_start[f],
+                                         obj.indices.begin() + obj.face_start[f + 1]));
   }
 
   T scale_factor = 1.0f / (max_coord * 1.25f); // scale to [-0.5, 0.5]
@@ -368,19 +364,29 @@ void parse_obj_file(const string &input_filename,
 
 void parse_bez_file(const string &input_filename,
                     const Transform<T, 3, Affine> &transformation) {
-    ifstream fin(input_filename);
-    int num_patches;
+    auto start = chrono::steady_clock::now();
+    MappedFile file(input_filename);
+    if (!file.is_open()) {
+        cerr << "Cannot open .bez file: " << input_filename << endl;
+        return;
+    }
+    TextScanner text(file.begin(), file.end());
+    int num_patches = 0;
 
-    fin >> num_patches;
+    text.integer(&num_patches);
 
     unique_ptr<BezierObject> bezier_object(new BezierObject(++obj_iter));
-    while (num_patches--) {
+    bezier_object->patches.reserve(max(num_patches, 0));
+    while (num_patches-- > 0) {
         vector<vector<shared_ptr<Vector3f>>> points;
         for (int i = 0; i < 4; i++) {
             vector<shared_ptr<Vector3f>> rowvec;
             for (int j = 0; j < 4; j++) {
                 T x, y, z;
-                fin >> x >> y >> z;
+                if (!(text.number(&x) && text.number(&y) && text.number(&z))) {
+                    cerr << "Truncated .bez file: " << input_filename << endl;
+                    return;
+                }
                 x += 1e-10;
                 y += 1e-10;
                 z += 1e-10;
@@ -393,7 +399,10 @@ void parse_bez_file(const string &input_filename,
         bezier_object->patches.push_back(move(bezier_pt));
     }
     bezier_object->transformation = transformation;
-    bezier_objects.push_back(move(bezier_object));;
+    bezier_objects.push_back(move(bezier_object));
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cerr << "Loaded " << input_filename << ": " << file.size / (1024.0 * 1024.0) << " MB in "
+         << seconds << " s (" << file.size / (1024.0 * 1024.0) / seconds << " MB/s)" << endl;
 }
 
 void compute_uniform_subdivisions() {
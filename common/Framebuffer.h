@@ -0,0 +1,79 @@
+#ifndef __FRAMEBUFFER_H
+#define __FRAMEBUFFER_H
+
+#include <cassert>
+#include <vector>
+
+/**
+ * Contiguous float RGB image, three floats per pixel.
+ *
+ * Rows are stored bottom-up (row 0 is the bottom of the image) to match the
+ * pixel coordinates of pngwriter and of a glOrtho(0, w, 0, h) viewport.
+ * Writers that touch disjoint pixels, e.g. one per Tile, need no locking.
+ */
+class Framebuffer {
+ public:
+    // A rectangular window [x0, x1) x [y0, y1) of the image. Coordinates
+    // passed to a Tile are image coordinates, not tile-local ones.
+    class Tile {
+     public:
+        Tile(Framebuffer *fb_, int x0_, int y0_, int x1_, int y1_) :
+            fb(fb_), x0(x0_), y0(y0_), x1(x1_), y1(y1_) {}
+        bool contains(int x, int y) const {
+            return x >= x0 && x < x1 && y >= y0 && y < y1;
+        }
+        float *pixel(int x, int y) {
+            assert(contains(x, y));
+            return fb->pixel(x, y);
+        }
+        template <class V>
+        void set(int x, int y, const V &color) {
+            assert(contains(x, y));
+            fb->set(x, y, color);
+        }
+        Framebuffer *fb;
+        int x0, y0, x1, y1;
+    };
+
+    Framebuffer() : width(0), height(0) {}
+    Framebuffer(int width_, int height_) {
+        resize(width_, height_);
+    }
+    ~Framebuffer() = default;
+    void resize(int width_, int height_) {
+        width = width_;
+        height = height_;
+        pixels.assign((size_t)width * height * 3, 0.0f);
+    }
+    void clear() {
+        pixels.assign(pixels.size(), 0.0f);
+    }
+    float *pixel(int x, int y) {
+        return &pixels[((size_t)y * width + x) * 3];
+    }
+    const float *pixel(int x, int y) const {
+        return &pixels[((size_t)y * width + x) * 3];
+    }
+    // Row-major view: the width * 3 floats of row y.
+    float *row(int y) {
+        return pixel(0, y);
+    }
+    void set(int x, int y, float r, float g, float b) {
+        float *p = pixel(x, y);
+        p[0] = r;
+        p[1] = g;
+        p[2] = b;
+    }
+    // Any color type with x, y, z members (both assignments' Vector classes).
+    template <class V>
+    void set(int x, int y, const V &color) {
+        set(x, y, color.x, color.y, color.z);
+    }
+    Tile tile(int x0, int y0, int x1, int y1) {
+        return Tile(this, x0, y0, x1, y1);
+    }
+    int width, height;
+    std::vector<float> pixels;
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef __MAPPED_FILE_H
+#define __MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Read-only memory mapping of a whole file. The contents are not copied;
+ * pages are read in by the OS as the parser touches them.
+ */
+class MappedFile {
+ public:
+    MappedFile() : data(nullptr), size(0) {}
+    explicit MappedFile(const std::string &path) : data(nullptr), size(0) {
+        open(path);
+    }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile() {
+        close();
+    }
+    bool open(const std::string &path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        if (size == 0) {
+            // mmap rejects empty mappings; an empty file is still valid.
+            ::close(fd);
+            data = "";
+            return true;
+        }
+        void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            size = 0;
+            return false;
+        }
+        madvise(addr, size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(addr);
+        mapped = true;
+        return true;
+    }
+    void close() {
+        if (mapped)
+            munmap(const_cast<char *>(data), size);
+        data = nullptr;
+        size = 0;
+        mapped = false;
+    }
+    bool is_open() const {
+        return data != nullptr;
+    }
+    const char *begin() const {
+        return data;
+    }
+    const char *end() const {
+        return data + size;
+    }
+    const char *data;
+    size_t size;
+
+ private:
+    bool mapped = false;
+};
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef __OBJ_LOADER_H
+#define __OBJ_LOADER_H
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "MappedFile.h"
+#include "TextScanner.h"
+
+/**
+ * Vertices and polygonal faces of a Wavefront .obj file. Only "v" and "f"
+ * records are kept; texture and normal indices in "f a/b/c" are dropped.
+ */
+struct ObjData {
+    std::vector<double> vertices;   // x, y, z of each vertex
+    std::vector<int> indices;       // 0-based vertex indices of every face, back to back
+    std::vector<int> face_start;    // face f is indices[face_start[f], face_start[f + 1])
+    size_t bytes = 0;
+    double seconds = 0.0;
+    int bad_faces = 0;              // faces with missing or out-of-range indices, skipped
+    int unknown_lines = 0;          // records other than v, vn, vt, f, g, o, s, usemtl, mtllib, #
+
+    int num_vertices() const {
+        return vertices.size() / 3;
+    }
+    int num_faces() const {
+        return face_start.empty() ? 0 : face_start.size() - 1;
+    }
+    double mb_per_sec() const {
+        return seconds > 0.0 ? bytes / (1024.0 * 1024.0) / seconds : 0.0;
+    }
+};
+
+namespace obj_loader {
+
+const size_t MIN_CHUNK_BYTES = 1 << 20;
+
+struct Chunk {
+    std::vector<double> vertices;
+    std::vector<int> indices;
+    std::vector<int> face_sizes;
+    // Entries of `indices` written from negative (relative) OBJ indices.
+    // They hold an index relative to the chunk's first vertex, which may
+    // itself be negative, until the chunk's base is known.
+    std::vector<size_t> relative;
+    int unknown_lines = 0;
+    int bad_faces = 0;
+};
+
+inline void skip_token_rest(TextScanner &line) {
+    while (line.p < line.end && *line.p != ' ' && *line.p != '\t')
+        line.p++;
+}
+
+inline void parse_chunk(const char *begin, const char *end, Chunk *chunk) {
+    TextScanner text(begin, end), line;
+    std::string_view type;
+    while (text.next_line(&line)) {
+        if (!line.word(&type))
+            continue;
+        if (type == "v") {
+            double x, y, z;
+            if (line.number(&x) && line.number(&y) && line.number(&z)) {
+                chunk->vertices.push_back(x);
+                chunk->vertices.push_back(y);
+                chunk->vertices.push_back(z);
+            } else {
+                chunk->unknown_lines++;
+            }
+        } else if (type == "f") {
+            int local_vertices = chunk->vertices.size() / 3;
+            size_t first = chunk->indices.size(), first_relative = chunk->relative.size();
+            bool ok = true;
+            int idx;
+            while (!line.at_end()) {
+                if (!line.integer(&idx) || idx == 0) {
+                    ok = false;
+                    break;
+                }
+                skip_token_rest(line);
+                if (idx > 0) {
+                    chunk->indices.push_back(idx - 1);
+                } else {
+                    chunk->relative.push_back(chunk->indices.size());
+                    chunk->indices.push_back(local_vertices + idx);
+                }
+            }
+            int count = chunk->indices.size() - first;
+            if (ok && count >= 3) {
+                chunk->face_sizes.push_back(count);
+            } else {
+                chunk->indices.resize(first);
+                chunk->relative.resize(first_relative);
+                chunk->bad_faces++;
+            }
+        } else if (type[0] == '#' || type == "vn" || type == "vt" || type == "g" ||
+                   type == "o" || type == "s" || type == "usemtl" || type == "mtllib") {
+            continue;
+        } else {
+            chunk->unknown_lines++;
+        }
+    }
+}
+
+}  // namespace obj_loader
+
+/**
+ * Loads an .obj file through a memory mapping. Files over a few MB are cut
+ * at line boundaries into chunks that are parsed on separate threads and
+ * then stitched together in file order. num_threads <= 0 uses every core.
+ */
+inline bool load_obj(const std::string &path, ObjData *out, int num_threads = 0) {
+    using namespace obj_loader;
+    auto start = std::chrono::steady_clock::now();
+    *out = ObjData();
+    MappedFile file(path);
+    if (!file.is_open())
+        return false;
+    out->bytes = file.size;
+
+    if (num_threads <= 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    int num_chunks = std::max<size_t>(1, std::min<size_t>(num_threads, file.size / MIN_CHUNK_BYTES));
+    std::vector<const char *> cuts(num_chunks + 1);
+    cuts[0] = file.begin();
+    cuts[num_chunks] = file.end();
+    for (int i = 1; i < num_chunks; i++) {
+        const char *cut = std::max(cuts[i - 1], file.begin() + file.size * i / num_chunks);
+        while (cut < file.end() && cut[-1] != '\n')
+            cut++;
+        cuts[i] = cut;
+    }
+
+    std::vector<Chunk> chunks(num_chunks);
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_chunks; i++)
+        threads.emplace_back(parse_chunk, cuts[i], cuts[i + 1], &chunks[i]);
+    parse_chunk(cuts[0], cuts[1], &chunks[0]);
+    for (auto &it : threads)
+        it.join();
+
+    size_t total_vertices = 0, total_indices = 0, total_faces = 0;
+    for (auto &chunk : chunks) {
+        total_vertices += chunk.vertices.size();
+        total_indices += chunk.indices.size();
+        total_faces += chunk.face_sizes.size();
+    }
+    out->vertices.reserve(total_vertices);
+    out->indices.reserve(total_indices);
+    out->face_start.reserve(total_faces + 1);
+    out->face_start.push_back(0);
+
+    int base = 0;
+    int num_vertices = total_vertices / 3;
+    for (auto &chunk : chunks) {
+        for (size_t r : chunk.relative)
+            chunk.indices[r] += base;
+        out->vertices.insert(out->vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+        size_t pos = 0;
+        for (int size : chunk.face_sizes) {
+            bool ok = true;
+            for (int k = 0; k < size; k++) {
+                int idx = chunk.indices[pos + k];
+                if (idx < 0 || idx >= num_vertices)
+                    ok = false;
+            }
+            if (ok) {
+                out->indices.insert(out->indices.end(), chunk.indices.begin() + pos,
+                                    chunk.indices.begin() + pos + size);
+                out->face_start.push_back(out->indices.size());
+            } else {
+                out->bad_faces++;
+            }
+            pos += size;
+        }
+        out->bad_faces += chunk.bad_faces;
+        out->unknown_lines += chunk.unknown_lines;
+        base += chunk.vertices.size() / 3;
+        std::vector<double>().swap(chunk.vertices);
+        std::vector<int>().swap(chunk.indices);
+    }
+
+    out->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef __TEXT_SCANNER_H
+#define __TEXT_SCANNER_H
+
+#include <charconv>
+#include <string_view>
+
+/**
+ * Allocation-free tokenizer over a character range, typically a
+ * MappedFile. Numbers are parsed in place with std::from_chars; tokens are
+ * returned as views into the underlying buffer.
+ */
+class TextScanner {
+ public:
+    TextScanner() : p(nullptr), end(nullptr) {}
+    TextScanner(const char *begin_, const char *end_) : p(begin_), end(end_) {}
+
+    // Splits off the next line (without its line terminator) into *line.
+    bool next_line(TextScanner *line) {
+        if (p >= end)
+            return false;
+        const char *eol = p;
+        while (eol < end && *eol != '\n')
+            eol++;
+        const char *last = eol;
+        if (last > p && last[-1] == '\r')
+            last--;
+        *line = TextScanner(p, last);
+        p = eol < end ? eol + 1 : eol;
+        return true;
+    }
+    void skip_spaces() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+            p++;
+    }
+    bool at_end() {
+        skip_spaces();
+        return p >= end;
+    }
+    // Next whitespace-delimited token.
+    bool word(std::string_view *out) {
+        skip_spaces();
+        if (p >= end)
+            return false;
+        const char *start = p;
+        while (p < end && !is_space(*p))
+            p++;
+        *out = std::string_view(start, p - start);
+        return true;
+    }
+    void skip_word() {
+        std::string_view ignored;
+        word(&ignored);
+    }
+    bool number(double *x) {
+        skip_spaces();
+        if (p < end && *p == '+')
+            p++;
+        std::from_chars_result res = std::from_chars(p, end, *x);
+        if (res.ec != std::errc())
+            return false;
+        p = res.ptr;
+        return true;
+    }
+    bool number(float *x) {
+        double d;
+        if (!number(&d))
+            return false;
+        *x = d;
+        return true;
+    }
+    // Leading integer of the next token; stops at the first non-digit, so
+    // for an OBJ "7/2/5" it reads 7 and leaves "/2/5".
+    bool integer(int *x) {
+        skip_spaces();
+        if (p < end && *p == '+')
+            p++;
+        std::from_chars_result res = std::from_chars(p, end, *x);
+        if (res.ec != std::errc())
+            return false;
+        p = res.ptr;
+        return true;
+    }
+    // Whatever is left of the range, without surrounding whitespace.
+    std::string_view rest() {
+        skip_spaces();
+        const char *last = end;
+        while (last > p && is_space(last[-1]))
+            last--;
+        return std::string_view(p, last - p);
+    }
+    const char *p, *end;
+
+ private:
+    static bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+};
+
+#endif